@@ -1,15 +1,21 @@
 #include "analog.h"
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 
 #include <Arduino.h>
 #undef abs    // because wiring's abs is a horrible macro
 #undef round  // because wiring's round is a horrible macro
-#undef PI     // because arm_math.h and Arduino both define one
 
-#include <arm_math.h>
 #include <wiring_private.h>   // for pinPeripheral
+#include <Adafruit_ZeroDMA.h>
+
+#include "config.h"
+#include "cvcapture.h"
+#include "cvslew.h"
+#include "eventlog.h"
+#include "lfo.h"
 
 
 // In this section of code, be very careful about numeric types
@@ -22,6 +28,26 @@
 ***  Control Voltage Outputs
 **/
 
+namespace {
+
+  // Outputs are streamed by DMA from blocks of samples, one buffer for each
+  // output, in two halves: while one half is being sent, the other is filled
+  // from the LFOs or slews. The samples are Q15 values, turned into whatever
+  // the output's register wants, with integer math only.
+
+  constexpr int32_t cvScale = 29491;    // 0.90 in Q15
+  constexpr int32_t cvOffset = 33423;   // 1.02 in Q15
+    // SAMD51 DAC outputs don't really go full scale, and snf asymmetrically.
+    // This scales the outputs to a reaonsable range, determined by scope.
+    // The same adjustment is used for the PWM outputs just to keep things
+    // simple.
+
+  inline uint32_t cvLevel(int16_t v) {
+    // in [0..65535]
+    return uint32_t(cvOffset + ((int32_t(v) * cvScale) >> 15));
+  }
+}
+
 #if defined(__SAMD51__)
 
 namespace {
@@ -29,8 +55,9 @@ namespace {
   // use DACs on A0 and A1 for c.v. 0 and 1
   // use PWM on A4 and A5 for c.v. 2 and 3
 
-  // The core's analogWrite system is used, but the PWM frequency is
-  // increased by modifying the prescaler used.
+  // The core's analogWrite system is used to set them up, but the PWM
+  // frequency is increased by modifying the prescaler used. After that, the
+  // registers are written by DMA.
 
   const std::array<uint32_t, numberOfCvOuts> cvPins =
     { PIN_A0, PIN_A1, PIN_A4, PIN_A5 };
@@ -54,18 +81,33 @@ namespace {
   }
 }
 
-void cvOut(int id, float v) {
-  // input is assumed in [-1.0..1.0]
+namespace {
 
-  constexpr float scale =  0.90;
-  constexpr float offset = 0.02;
-    // SAMD51 DAC outputs don't really go full scale, and snf asymmetrically.
-    // This scales the outputs to a reaonsable range, determined by scope.
-    // The same adjustment is used for the PWM outputs just to keep things
-    // simple.
+  // The DACs take 12 bits, and TC0 & TC1 count 8 bits, which DMA takes from
+  // the low byte of each sample.
+
+  typedef uint16_t CvCode;
+
+  inline CvCode cvCode(int id, int16_t v) {
+    return CvCode(id < 2 ? cvLevel(v) >> 4 : cvLevel(v) >> 8);
+  }
 
-  uint16_t s = round((v * scale + offset + 1.0) * 32768);
-  analogWrite(cvPins[id], s);
+  void addCvDescriptor(Adafruit_ZeroDMA& dma, int id, CvCode* src, size_t n) {
+    switch (id) {
+      case 0:
+      case 1:
+        dma.addDescriptor(src, const_cast<uint16_t*>(&DAC->DATA[id].reg),
+          n, DMA_BEAT_SIZE_HWORD, true, false);
+        break;
+
+      default:
+        dma.addDescriptor(src,
+          const_cast<uint8_t*>(&(id == 2 ? TC0 : TC1)->COUNT8.CCBUF[0].reg),
+          n, DMA_BEAT_SIZE_BYTE, true, false,
+          DMA_ADDRESS_INCREMENT_STEP_SIZE_2, DMA_STEPSEL_SRC);
+        break;
+    }
+  }
 }
 
 #endif
@@ -85,6 +127,7 @@ namespace {
   constexpr float pwmTimerClockRate = F_CPU / 1;
   constexpr float pwmTimerPeriod =
     round(pwmTimerClockRate / pwmDesiredSampleRate);
+  constexpr uint32_t pwmPeriod = uint32_t(pwmTimerPeriod);
 
   inline void sync(Tcc* tcc, uint32_t mask) {
     while(tcc->SYNCBUSY.reg & mask);
@@ -123,21 +166,18 @@ namespace {
   const std::array<int, numberOfCvOuts> cvChannels =
     { 0, 1, 3, 2 };
     // the last two were accidentially wired swapped to the outputs
-}
 
+  typedef uint32_t CvCode;
 
-void cvOut(int id, float v) {
-  // input is assumed in [-1.0..1.0]
-
-  constexpr float scale =  0.90f;
-  constexpr float offset = 0.02f;
-    // SAMD51 DAC outputs don't really go full scale, and snf asymmetrically.
-    // This scales the outputs to a reaonsable range, determined by scope.
-    // The same adjustment is used for the PWM outputs just to keep things
-    // simple.
+  inline CvCode cvCode(int, int16_t v) {
+    return (cvLevel(v) * pwmPeriod) >> 16;
+  }
 
-  uint32_t s = lround((v * scale + offset + 1.0f) * (pwmTimerPeriod / 2.0f));
-  TCC0->CCB[cvChannels[id]].reg = s;
+  void addCvDescriptor(Adafruit_ZeroDMA& dma, int id, CvCode* src, size_t n) {
+    dma.addDescriptor(src,
+      const_cast<uint32_t*>(&TCC0->CCB[cvChannels[size_t(id)]].reg),
+      n, DMA_BEAT_SIZE_WORD, true, false);
+  }
 }
 
 
@@ -148,57 +188,212 @@ void cvOut(int id, float v) {
 ***  Trigger Outputs
 **/
 
+// Outputs are written straight to the port registers, all the ones on the
+// same port with one write. Pulses rise at once, and fall from TC4's compare
+// interrupt, so their widths don't depend on how busy the main loop is.
+
 namespace {
 
+  const uint32_t noPin = ~0ul;
   const std::array<uint32_t, numberOfTrigOuts> trigPins =
-    { PIN_SPI_MISO, PIN_SPI_SCK, PIN_SERIAL1_TX, PIN_SPI_MOSI };
+    { PIN_SPI_MISO, PIN_SPI_SCK,
+      config.dinMidi ? noPin : PIN_SERIAL1_TX,  // unless it's MIDI out
+      PIN_SPI_MOSI };
+
+  const int portCount = 2;
+  std::array<std::array<uint32_t, numberOfTrigOuts>, portCount> trigMasks;
+    // for each port, the bit for each output, or zero if it is elsewhere
+
+  void trigWrite(uint8_t rising, uint8_t falling) {
+    for (int g = 0; g < portCount; ++g) {
+      uint32_t set = 0;
+      uint32_t clr = 0;
+      for (int i = 0; i < numberOfTrigOuts; ++i) {
+        if (rising & (1 << i))  set |= trigMasks[size_t(g)][size_t(i)];
+        if (falling & (1 << i)) clr |= trigMasks[size_t(g)][size_t(i)];
+      }
+      if (set) PORT->Group[g].OUTSET.reg = set;
+      if (clr) PORT->Group[g].OUTCLR.reg = clr;
+    }
+  }
+
+
+  // TC4 counts freely, in 16 bits, at about 500kHz ~ 750kHz. Pulses are kept
+  // under half the wrap around, so due times can be compared by difference.
+
+#if defined(__SAMD51__)
+  constexpr float trigTimerClockRate = F_CPU / 256;
+#else
+  constexpr float trigTimerClockRate = F_CPU / 64;
+#endif
+  constexpr float maxPulseMicros = 25400;
+  static_assert(maxPulseMicros * trigTimerClockRate / 1e6f < 32000,
+    "trigger pulses must fit in half the timer");
+
+  std::array<uint16_t, numberOfTrigOuts> trigTicks = { 0, 0, 0, 0 };
+    // pulse width, 0 if the output is a gate
+  std::array<uint16_t, numberOfTrigOuts> trigDue;
+  volatile uint8_t trigFalling = 0;   // outputs waiting to fall
+
+  void setupTrigTimer() {
+#if defined(__SAMD51__)
+    GCLK->PCHCTRL[TC4_GCLK_ID].reg =
+      GCLK_PCHCTRL_CHEN | GCLK_PCHCTRL_GEN_GCLK0;
+
+    TC4->COUNT16.CTRLA.bit.SWRST = 1;
+    while (TC4->COUNT16.SYNCBUSY.bit.SWRST);
+
+    TC4->COUNT16.CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_PRESCALER_DIV256;
+    TC4->COUNT16.CTRLA.bit.ENABLE = 1;
+    while (TC4->COUNT16.SYNCBUSY.bit.ENABLE);
+#endif
+#if defined(__SAMD21G18A__)
+    GCLK->CLKCTRL.reg
+      = GCLK_CLKCTRL_CLKEN
+      | GCLK_CLKCTRL_GEN_GCLK0
+      | GCLK_CLKCTRL_ID(GCM_TC4_TC5);
+
+    TC4->COUNT16.CTRLA.reg = TC_CTRLA_SWRST;
+    while(TC4->COUNT16.STATUS.bit.SYNCBUSY);
+
+    TC4->COUNT16.CTRLA.reg = TC_CTRLA_MODE_COUNT16 | TC_CTRLA_PRESCALER_DIV64;
+    TC4->COUNT16.READREQ.reg = TC_READREQ_RCONT | TC_READREQ_ADDR(0x10);
+      // keep COUNT synchronized, so it can be read at any time
+    while(TC4->COUNT16.STATUS.bit.SYNCBUSY);
+
+    TC4->COUNT16.CTRLA.bit.ENABLE = 1;
+    while(TC4->COUNT16.STATUS.bit.SYNCBUSY);
+#endif
+
+    NVIC_SetPriority(TC4_IRQn, 0);
+    NVIC_EnableIRQ(TC4_IRQn);
+  }
+
+  uint16_t trigCount() {
+#if defined(__SAMD51__)
+    TC4->COUNT16.CTRLBSET.reg = TC_CTRLBSET_CMD_READSYNC;
+    while (TC4->COUNT16.SYNCBUSY.bit.CTRLB);
+    while (TC4->COUNT16.CTRLBSET.bit.CMD);
+#endif
+    return TC4->COUNT16.COUNT.reg;
+  }
+
+  void trigCompare(uint16_t t) {
+    TC4->COUNT16.CC[0].reg = t;
+#if defined(__SAMD51__)
+    while (TC4->COUNT16.SYNCBUSY.bit.CC0);
+#else
+    while (TC4->COUNT16.STATUS.bit.SYNCBUSY);
+#endif
+    TC4->COUNT16.INTFLAG.reg = TC_INTFLAG_MC0;
+    TC4->COUNT16.INTENSET.reg = TC_INTENSET_MC0;
+  }
+
+  void trigSchedule() {
+    // drops any pulses now due, and sets the compare for the next one
+    // call with interrupts off, or from the interrupt
+
+    for (;;) {
+      uint16_t now = trigCount();
+      uint8_t falling = 0;
+      int32_t soonest = 0x7fff;
+
+      for (int i = 0; i < numberOfTrigOuts; ++i) {
+        if (!(trigFalling & (1 << i))) continue;
+        int32_t d = int16_t(trigDue[size_t(i)] - now);
+        if (d <= 2)           falling |= uint8_t(1 << i);
+        else if (d < soonest) soonest = d;
+      }
+
+      if (falling) {
+        trigFalling &= uint8_t(~falling);
+        trigWrite(0, falling);
+      }
+
+      if (!trigFalling) {
+        TC4->COUNT16.INTENCLR.reg = TC_INTENCLR_MC0;
+        return;
+      }
+
+      uint16_t next = uint16_t(now + soonest);
+      trigCompare(next);
+      if (int16_t(next - trigCount()) > 0)
+        return;
+      // it went by while being set, go around again
+    }
+  }
 
 
   void setupTrig() {
-    for (auto& pin : trigPins)
+    for (auto& m : trigMasks)
+      m.fill(0);
+
+    for (int i = 0; i < numberOfTrigOuts; ++i) {
+      uint32_t pin = trigPins[size_t(i)];
+      if (pin == noPin) continue;
       pinMode(pin, OUTPUT);
+      const PinDescription& d = g_APinDescription[pin];
+      trigMasks[size_t(d.ulPort)][size_t(i)] = 1ul << d.ulPin;
+    }
+
+    setupTrigTimer();
   }
 }
 
-void trigOut(int id, bool v) {
-  digitalWrite(trigPins[id], v ? HIGH : LOW);
+void TC4_Handler() {
+  if (TC4->COUNT16.INTFLAG.reg & TC_INTFLAG_MC0) {
+    TC4->COUNT16.INTFLAG.reg = TC_INTFLAG_MC0;  // writing 1 clears the flag
+    trigSchedule();
+  }
 }
 
 
-/**
-***  Test Waveforms
-**/
+// These may be called from interrupts too, such as the c.v. block fill.
 
+void trigOut(int id, bool v) {
+  uint8_t bit = uint8_t(1 << id);
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  trigFalling &= uint8_t(~bit);
+  if (v)  trigWrite(bit, 0);
+  else    trigWrite(0, bit);
+  __set_PRIMASK(primask);
+}
 
-namespace {
+void trigPulse(int id) {
+  uint8_t bit = uint8_t(1 << id);
 
-  enum TestWave {
-    testBegin,
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  trigWrite(bit, 0);
+  trigDue[size_t(id)] = uint16_t(trigCount() + trigTicks[size_t(id)]);
+  trigFalling |= bit;
+  trigSchedule();
+  __set_PRIMASK(primask);
+}
 
-    testOff = testBegin,
-    testSine,
-    testTriangle,
-    testSaw,
-    testSquare,
+void trigNote(int id, bool on) {
+  if (trigTicks[size_t(id)] == 0) trigOut(id, on);
+  else if (on)                    trigPulse(id);
+}
 
-    testEnd
-  };
 
-  TestWave testType = testOff;
+/**
+***  LFOs & Slews
+**/
 
-  constexpr float twoPi = 2.0f * PI;
+namespace {
 
-  inline float waveform(float p) {
-    // phase is in range [0.0..1.0)
-    // produces a value in the range [-1.0..1.0]
-    switch (testType) {
-      case testSine:      return arm_sin_f32(p * twoPi);
-      case testTriangle:  return 4 * (p < 0.5 ? p : (1 - p)) - 1;
-      case testSaw:       return 2 * p - 1;
-      default:
-      case testSquare:    return p < 0.5 ? -1 : 1;
-    }
-  }
+  std::array<CvSlew, numberOfCvOuts> slews;
+
+  std::array<Lfo, numberOfCvOuts> lfos;
+  std::array<float, numberOfCvOuts> lfoHz = { 1.0f, 1.0f, 1.0f, 1.0f };
+  std::array<uint8_t, numberOfCvOuts> lfoCycles = { 0, 0, 0, 0 };
+    // when synced, cycles per loop, 0 is free running
+
+  bool testTrigs = false;   // trigger outputs follow the LFOs, for testing
+  int testType = -1;        // an LfoShape, or -1 when not testing
 
 }
 
@@ -206,8 +401,8 @@ namespace {
 #if defined(__SAMD51__) || defined(__SAMD21G18A__)
 
 namespace {
-  // set up TC3 to be sample interrupt for test waveforms
-  // use timer in 8 bit mode, with a prescale of 1024
+  // set up TC3 to be the sample clock, which triggers the DMA
+  // use timer in 8 bit mode, with a prescale of 256
 
   constexpr float waveformDesiredSampleRate = 2000;  // Hz
   constexpr float waveformTimerClockRate = F_CPU / 256;
@@ -252,46 +447,266 @@ namespace {
     TC3->COUNT8.CTRLA.bit.ENABLE = 1;
     while(TC3->COUNT8.STATUS.bit.SYNCBUSY);
 #endif
+  }
+
 
-    NVIC_SetPriority(TC3_IRQn, 0);
-    NVIC_EnableIRQ(TC3_IRQn);
+  constexpr size_t blockSize = 8;   // samples, 4ms at 2kHz
+
+  std::array<std::array<CvCode, 2 * blockSize>, numberOfCvOuts> cvBlocks;
+  std::array<Adafruit_ZeroDMA, numberOfCvOuts> cvDma;
+  size_t nextHalf = 0;
+
+  void fillBlock(size_t half) {
+    for (int i = 0; i < numberOfCvOuts; ++i) {
+      size_t u = size_t(i);
+      CvCode* out = &cvBlocks[u][half * blockSize];
+      Lfo& l = lfos[u];
+
+      if (l.on()) {
+        for (size_t n = 0; n < blockSize; ++n)
+          out[n] = cvCode(i, l.tick());
+        if (testTrigs)
+          trigOut(i, l.at() < 0x1999999au);   // the first tenth of the cycle
+      } else {
+        CvSlew& s = slews[u];
+        for (size_t n = 0; n < blockSize; ++n)
+          out[n] = cvCode(i, s.next());
+      }
+    }
   }
 
-  void startWaveformTimer() {
-    TC3->COUNT8.INTENSET.reg = TC_INTENSET_OVF;
+  void blockDone(Adafruit_ZeroDMA*) {
+    // all the channels run off the same trigger, so when the first is done
+    // with a half, so are the others
+    fillBlock(nextHalf);
+    nextHalf ^= 1;
   }
 
-  void stopWaveformTimer() {
-    TC3->COUNT8.INTENCLR.reg = TC_INTENCLR_OVF;
+  void setupCvDma() {
+    fillBlock(0);
+    fillBlock(1);
+
+    for (int i = 0; i < numberOfCvOuts; ++i) {
+      size_t u = size_t(i);
+      Adafruit_ZeroDMA& dma = cvDma[u];
+      dma.allocate();
+      dma.setTrigger(TC3_DMAC_ID_OVF);
+      dma.setAction(DMA_TRIGGER_ACTON_BEAT);
+      addCvDescriptor(dma, i, &cvBlocks[u][0], blockSize);
+      addCvDescriptor(dma, i, &cvBlocks[u][blockSize], blockSize);
+      dma.loop(true);
+      if (i == 0)
+        dma.setCallback(blockDone);
+      dma.startJob();
+    }
   }
 
+}
+
+#endif // defined(__SAMD51__) || defined(__SAMD21__)
 
-  std::array<float, 4> phase = { 0.0, 0.0, 0.0, 0.0 };
-  std::array<float, 4> delta = {
-    10.0f /* Hz */ / waveformSampleRate,
-    11.0f /* Hz */ / waveformSampleRate,
-    12.0f /* Hz */ / waveformSampleRate,
-    13.0f /* Hz */ / waveformSampleRate,
+
+/**
+***  C.V. Inputs
+**/
+
+// The ADC runs freely, averaging 8 conversions into each sample, at about
+// 1.5kHz for each input, and DMA moves the samples into blocks, in two halves
+// as for the outputs. The DMA callback only counts the blocks. They're turned
+// into events from analogUpdate(), in the main loop, a block at a time.
+//
+// SAMD51 has two ADCs, one for each input. SAMD21 has one, which scans the
+// two inputs in turn, so its blocks interleave them.
+
+#if defined(__SAMD51__) || defined(__SAMD21G18A__)
+
+namespace {
+
+  constexpr size_t cvInBlock = 8;   // samples of each input, about 5ms
+
+#if defined(__SAMD51__)
+  constexpr size_t cvInStreamCount = 2;
+  constexpr size_t cvInsPerStream = 1;
+
+  Adc* const cvInAdcs[cvInStreamCount] = { ADC0, ADC1 };
+  const uint32_t cvInMux[cvInStreamCount] =
+    { ADC_INPUTCTRL_MUXPOS_AIN2_Val, ADC_INPUTCTRL_MUXPOS_AIN1_Val };
+    // A2 is PB08, AIN2 on ADC0, and A3 is PB09, AIN1 on ADC1
+  const uint8_t cvInTriggers[cvInStreamCount] =
+    { ADC0_DMAC_ID_RESRDY, ADC1_DMAC_ID_RESRDY };
+  const std::array<uint32_t, numberOfCvIns> cvInPins = { PIN_A2, PIN_A3 };
+
+  void setupCvInAdc(size_t s) {
+    // the core has the ADC clocks running, from the 48MHz GCLK1
+    Adc* adc = cvInAdcs[s];
+
+    adc->CTRLA.bit.ENABLE = 0;
+    while (adc->SYNCBUSY.bit.ENABLE);
+
+    adc->CTRLA.bit.PRESCALER = ADC_CTRLA_PRESCALER_DIV256_Val;
+    adc->CTRLB.reg = ADC_CTRLB_RESSEL_16BIT | ADC_CTRLB_FREERUN;
+      // averaging wants the 16 bit result, which ADJRES brings back to 12
+    while (adc->SYNCBUSY.bit.CTRLB);
+    adc->REFCTRL.reg = ADC_REFCTRL_REFSEL_INTVCC1;    // VDDANA
+    while (adc->SYNCBUSY.bit.REFCTRL);
+    adc->AVGCTRL.reg = ADC_AVGCTRL_SAMPLENUM_8 | ADC_AVGCTRL_ADJRES(3);
+    while (adc->SYNCBUSY.bit.AVGCTRL);
+    adc->SAMPCTRL.reg = ADC_SAMPCTRL_SAMPLEN(3);
+    while (adc->SYNCBUSY.bit.SAMPCTRL);
+    adc->INPUTCTRL.reg =
+      ADC_INPUTCTRL_MUXPOS(cvInMux[s]) | ADC_INPUTCTRL_MUXNEG_GND;
+    while (adc->SYNCBUSY.bit.INPUTCTRL);
+
+    adc->CTRLA.bit.ENABLE = 1;
+    while (adc->SYNCBUSY.bit.ENABLE);
+    adc->SWTRIG.bit.START = 1;
+  }
+
+  void* cvInResult(size_t s) {
+    return const_cast<uint16_t*>(&cvInAdcs[s]->RESULT.reg);
+  }
+#endif
+
+#if defined(__SAMD21G18A__)
+  constexpr size_t cvInStreamCount = 1;
+  constexpr size_t cvInsPerStream = 2;
+
+  const uint8_t cvInTriggers[cvInStreamCount] = { ADC_DMAC_ID_RESRDY };
+  const std::array<uint32_t, numberOfCvIns> cvInPins = { PIN_A1, PIN_A2 };
+
+  void setupCvInAdc(size_t) {
+    // the core has the ADC clock running, from the 48MHz GCLK0
+    ADC->CTRLA.bit.ENABLE = 0;
+    while (ADC->STATUS.bit.SYNCBUSY);
+
+    ADC->CTRLB.reg = ADC_CTRLB_PRESCALER_DIV256 | ADC_CTRLB_RESSEL_16BIT
+      | ADC_CTRLB_FREERUN;
+      // averaging wants the 16 bit result, which ADJRES brings back to 12
+    while (ADC->STATUS.bit.SYNCBUSY);
+    ADC->REFCTRL.reg = ADC_REFCTRL_REFSEL_INTVCC1;
+      // VDDANA / 2, with the gain of 1/2 below for the full range, as the
+      // core does
+    ADC->AVGCTRL.reg = ADC_AVGCTRL_SAMPLENUM_8 | ADC_AVGCTRL_ADJRES(3);
+    ADC->SAMPCTRL.reg = ADC_SAMPCTRL_SAMPLEN(3);
+    ADC->INPUTCTRL.reg = ADC_INPUTCTRL_MUXPOS_PIN2 | ADC_INPUTCTRL_MUXNEG_GND
+      | ADC_INPUTCTRL_INPUTSCAN(1) | ADC_INPUTCTRL_GAIN_DIV2;
+      // A1 is PB08, AIN2, and A2 is PB09, AIN3: a scan of two from AIN2
+    while (ADC->STATUS.bit.SYNCBUSY);
+
+    ADC->CTRLA.bit.ENABLE = 1;
+    while (ADC->STATUS.bit.SYNCBUSY);
+    ADC->SWTRIG.bit.START = 1;
+  }
+
+  void* cvInResult(size_t) {
+    return const_cast<uint16_t*>(&ADC->RESULT.reg);
+  }
+#endif
+
+  static_assert(cvInStreamCount * cvInsPerStream == numberOfCvIns,
+    "every input is in a stream");
+
+  constexpr size_t cvInHalf = cvInBlock * cvInsPerStream;
+
+  struct CvInStream {
+    Adafruit_ZeroDMA dma;
+    std::array<uint16_t, 2 * cvInHalf> samples;
+    volatile uint32_t blocksDone;     // by the DMA callback
+    uint32_t blocksTaken;             // by analogUpdate()
   };
 
-  int tickCount = 0;
+  std::array<CvInStream, cvInStreamCount> cvInStreams;
+  std::array<CvCapture, numberOfCvIns> cvCaptures;
+  uint16_t cvInBlocksLost = 0;
 
-  void waveformTick() {
-    ++tickCount;
-    for (int i = 0; i < phase.size(); ++i) {
-      auto p = phase[i] = fmodf(phase[i] + delta[i], 1.0);
+  // events wait here for cvInEvent()
+  constexpr uint32_t cvInQueueSize = 32;    // must be a power of two
+  std::array<MidiEvent, cvInQueueSize> cvInQueue;
+  uint32_t cvInHead = 0;
+  uint32_t cvInTail = 0;
 
-      cvOut(i, waveform(p));
-      trigOut(i, p < 0.10);
+  void cvInBlockDone(Adafruit_ZeroDMA* dma) {
+    for (auto& st : cvInStreams)
+      if (&st.dma == dma)
+        st.blocksDone += 1;
+  }
+
+  void setupCvIn() {
+    for (auto pin : cvInPins)
+      pinPeripheral(pin, PIO_ANALOG);
+
+    cvCaptures[0].mode(cvInPitch, 0);
+    cvCaptures[1].mode(cvInGate, 1);
+      // ready for a sequencer's c.v. & gate
+
+    for (size_t s = 0; s < cvInStreamCount; ++s) {
+      CvInStream& st = cvInStreams[s];
+      st.blocksDone = 0;
+      st.blocksTaken = 0;
+
+      st.dma.allocate();
+      st.dma.setTrigger(cvInTriggers[s]);
+      st.dma.setAction(DMA_TRIGGER_ACTON_BEAT);
+      st.dma.addDescriptor(cvInResult(s), &st.samples[0],
+        cvInHalf, DMA_BEAT_SIZE_HWORD, false, true);
+      st.dma.addDescriptor(cvInResult(s), &st.samples[cvInHalf],
+        cvInHalf, DMA_BEAT_SIZE_HWORD, false, true);
+      st.dma.loop(true);
+      st.dma.setCallback(cvInBlockDone);
+      st.dma.startJob();
+
+      setupCvInAdc(s);
     }
   }
 
-}
+  int16_t gatePitch() {
+    // from the first input in pitch mode, if any
+    for (auto& c : cvCaptures)
+      if (c.mode() == cvInPitch)
+        return c.note();
+    return -1;
+  }
 
-void TC3_Handler() {
-  if (TC3->COUNT8.INTFLAG.reg & TC_INTFLAG_OVF) {
-    waveformTick();
-    TC3->COUNT8.INTFLAG.reg = TC_INTFLAG_OVF;   // writing 1 clears the flag
+  void takeCvInBlock(size_t s, const uint16_t* block) {
+    // level and pitch inputs first, so gates get this block's pitch
+    for (int gates = 0; gates < 2; ++gates) {
+      for (size_t k = 0; k < cvInsPerStream; ++k) {
+        CvCapture& c = cvCaptures[s * cvInsPerStream + k];
+        if ((c.mode() == cvInGate) != (gates == 1)) continue;
+
+        MidiEvent evs[CvCapture::maxEvents];
+        size_t n = c.block(&block[k], cvInBlock, cvInsPerStream,
+          gates ? gatePitch() : int16_t(-1), evs);
+        for (size_t i = 0; i < n; ++i)
+          cvInQueue[cvInHead++ % cvInQueueSize] = evs[i];
+      }
+    }
+  }
+
+  void cvInUpdate() {
+    for (size_t s = 0; s < cvInStreamCount; ++s) {
+      CvInStream& st = cvInStreams[s];
+      uint32_t done = st.blocksDone;
+
+      if (done - st.blocksTaken > 1) {
+        // the halves behind the last one done have been written over
+        uint32_t lost = done - st.blocksTaken - 1;
+        cvInBlocksLost = uint16_t(std::min<uint32_t>(
+          cvInBlocksLost + lost, 0xffff));
+        st.blocksTaken = done - 1;
+      }
+
+      while (st.blocksTaken != done) {
+        if (cvInQueueSize - (cvInHead - cvInTail)
+            < cvInsPerStream * CvCapture::maxEvents)
+          return;
+          // no room, the block waits for the events to be taken
+
+        size_t half = st.blocksTaken % 2;
+        takeCvInBlock(s, &st.samples[half * cvInHalf]);
+        st.blocksTaken += 1;
+      }
+    }
   }
 }
 
@@ -307,48 +722,132 @@ void TC3_Handler() {
 **/
 
 void analogBegin() {
+  Lfo::begin();
+
   setupCv();
   setupTrig();
 
-  for (int i = 0; i < numberOfCvOuts; ++i)
-    cvOut(i, 0.0f);
   for (int i = 0; i < numberOfTrigOuts; ++i)
     trigOut(i, false);
 
-  setupWaveformTimer();
+  setupCvDma();
+  setupWaveformTimer();   // starts the DMA going
+
+  if (config.cvIn)
+    setupCvIn();
 }
 
-void analogUpdate(unsigned long now) {
+void analogUpdate(unsigned long) {
+  if (config.cvIn)
+    cvInUpdate();
 }
 
-void toggleTestWave() {
-  switch (testType) {
-    case testOff:
-      testType = testSine;
-      Serial.println("test output waveform sine");
-      break;
-    case testSine:
-      testType = testTriangle;
-      Serial.println("test output waveform triangle");
-      break;
-    case testTriangle:
-      testType = testSaw;
-      Serial.println("test output waveform saw");
-      break;
-    case testSaw:
-      testType = testSquare;
-      Serial.println("test output waveform square");
-      break;
-    case testSquare:
-    default:
-      testType = testOff;
-      Serial.println("test output waveform off");
-      break;
-  }
-
-  if (testType == testOff)    stopWaveformTimer();
-  else                        startWaveformTimer();
+
+void cvOut(int id, float v) {
+  // input is assumed in [-1.0..1.0]
+
+  v = v < -1.0f ? -1.0f : v > 1.0f ? 1.0f : v;
+  slews[id].target(int16_t(lroundf(v * 32767.0f)));
+}
+
+void cvGlide(int id, uint8_t v) {
+  float ms = v * v / 8.0f;
+  slews[id].time(uint16_t(ms * waveformSampleRate / 1000.0f));
+}
+
+void cvGlideMode(int id, uint8_t v) {
+  slews[id].mode(CvGlide(v * glideCount / 128));
+}
+
+
+void trigWidth(int id, uint8_t v) {
+  float us = v * (maxPulseMicros / 127.0f);
+  trigTicks[id] = uint16_t(us * trigTimerClockRate / 1e6f);
+}
+
+
+void lfoShape(int id, uint8_t v) {
+  lfos[id].shape(LfoShape(v * lfoShapeCount / 128));
+}
+
+void lfoRate(int id, uint8_t v) {
+  lfoHz[id] = 0.02f * powf(2.0f, v / 12.7f);
+  if (!lfoCycles[id])
+    lfos[id].frequency(lfoHz[id], waveformSampleRate);
+}
+
+void lfoDepth(int id, uint8_t v) {
+  lfos[id].depth(int16_t(v * 32767 / 127));
 }
 
+void lfoSync(int id, uint8_t v) {
+  static const uint8_t cycles[] = { 0, 1, 2, 3, 4, 6, 8, 12, 16 };
+  lfoCycles[id] = cycles[v * sizeof(cycles) / 128];
+  if (!lfoCycles[id])
+    lfos[id].frequency(lfoHz[id], waveformSampleRate);
+}
+
+void lfoLoop(uint32_t length, uint32_t position) {
+  static uint32_t lastPosition = 0;
+  bool restarted = position < lastPosition;
+  lastPosition = position;
+
+  if (length == 0) return;
+  uint32_t samples = uint32_t(length * (waveformSampleRate / 1000.0f));
 
+  for (int i = 0; i < numberOfCvOuts; ++i) {
+    if (!lfoCycles[i]) continue;
+    lfos[i].cyclesPer(samples, lfoCycles[i]);
+    if (restarted)
+      lfos[i].reset();
+  }
+}
+
+
+void cvInMode(int id, uint8_t v) {
+  cvCaptures[size_t(id)].mode(CvInMode(v * cvInModeCount / 128), uint8_t(id));
+}
 
+bool cvInEvent(MidiEvent& ev) {
+  if (cvInTail == cvInHead)
+    return false;
+  ev = cvInQueue[cvInTail++ % cvInQueueSize];
+  return true;
+}
+
+uint16_t cvInOverruns() {
+  return cvInBlocksLost;
+}
+
+
+void toggleTestWave() {
+  // steps all the LFOs through the shapes, and then off
+
+  testType += 1;
+  if (testType > lfoSquare) {
+    testType = -1;
+    testTrigs = false;
+    for (auto& l : lfos)
+      l.depth(0);
+    for (int i = 0; i < numberOfTrigOuts; ++i)
+      trigOut(i, false);
+    logMessage("test output waveform off");
+  }
+  else {
+    for (int i = 0; i < numberOfCvOuts; ++i) {
+      lfoCycles[i] = 0;
+      lfos[i].frequency(10.0f + i /* Hz */, waveformSampleRate);
+      lfos[i].shape(LfoShape(testType));
+      lfos[i].depth(32767);
+    }
+    testTrigs = true;
+
+    static const char* messages[] = {
+      "test output waveform sine",
+      "test output waveform triangle",
+      "test output waveform saw",
+      "test output waveform square",
+    };
+    logMessage(messages[testType]);
+  }
+}
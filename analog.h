@@ -1,6 +1,10 @@
 #ifndef _INCLUDE_ANALOG_H_
 #define _INCLUDE_ANALOG_H_
 
+#include <cstdint>
+
+#include "types.h"
+
 void analogBegin();
 void analogUpdate(unsigned long);
 
@@ -9,11 +13,46 @@ const int numberOfTrigOuts = 4;
 
 void cvOut(int, float);
   // outputs are A0, A1, A4, A5
+  // the output slews to this level, unless its LFO is on
+
+void cvGlide(int, uint8_t);       // CC value, 0 ~ 2s
+void cvGlideMode(int, uint8_t);   // CC value: step, linear, exponential
 
 void trigOut(int, bool);
   // outputs are MISO, SCK, TX, MOSI
   // which are also known as Tuplet, Beat, Measure, Sequence
 
+void trigPulse(int);
+  // a pulse of the output's width, timed in hardware
+void trigNote(int, bool);
+  // a pulse on note on, or if the width is zero, a gate for the note
+
+void trigWidth(int, uint8_t);     // CC value, 0 is a gate, else 0.2 ~ 25.4ms
+
+// Each c.v. output has an LFO, which has the output while its depth is
+// non-zero. These all take a CC value, [0..127].
+void lfoShape(int, uint8_t);    // sine, triangle, saw, square, random
+void lfoRate(int, uint8_t);     // 0.02Hz ~ 20Hz
+void lfoDepth(int, uint8_t);
+void lfoSync(int, uint8_t);     // 0 is free running, else 1 ~ 16 cycles per loop
+
+void lfoLoop(uint32_t length, uint32_t position);
+  // call from loop() while looping, to keep synced LFOs in time
+
 void toggleTestWave();
 
+
+// C.v. inputs are sampled by the ADC, averaging in hardware, into blocks by
+// DMA, and analogUpdate() turns each block into the few events worth
+// recording, see cvcapture.h. They need config.cvIn.
+const int numberOfCvIns = 2;
+  // inputs are A2 & A3, on SAMD21 A1 & A2
+
+void cvInMode(int, uint8_t);      // CC value: off, level, pitch, gate
+bool cvInEvent(MidiEvent&);
+  // call from loop(), after analogUpdate(), until false, to take the events
+  // for the loop
+uint16_t cvInOverruns();
+  // blocks written over before analogUpdate() got to them
+
 #endif // _INCLUDE_ANALOG_H_
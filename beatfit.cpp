@@ -0,0 +1,270 @@
+#include "beatfit.h"
+
+#include <algorithm>
+
+
+namespace {
+  const AbsTime binWidth = 10;
+  const uint16_t binCount = 3 * maxBeat / binWidth + 2;
+    // room for the bins either side of three times the longest beat
+
+  const AbsTime chordWidth = 30;
+    // onsets closer than this are taken as one, as in a chord
+
+  const AbsTime fitTolerance = 20;
+    // lengths closer than this are taken as the same
+
+  const int32_t rivalMargin = 8;
+    // a beat scoring within this of the best is as likely
+
+  uint16_t score(const uint8_t* hist, uint16_t b) {
+    // pairs about one, two, and three beats apart
+    uint16_t s = 0;
+    for (uint16_t k = 1; k <= 3; ++k) {
+      uint16_t kb = k * b;
+      s += hist[kb - 1] + hist[kb] + hist[kb + 1];
+    }
+    return s;
+  }
+
+  struct Line {
+    uint64_t sumMT = 0;
+    uint64_t sumMM = 0;
+  };
+
+  Line fitLine(const AbsTime* t, uint16_t n, AbsTime beat) {
+    // The loop starts on the first onset, so the beat is the slope of a line
+    // through zero, fitted by least squares to the onsets near the grid,
+    // against their beat numbers. Across a whole loop, this is far more exact
+    // than the histogram.
+    Line line;
+    for (uint16_t i = 1; i < n; ++i) {
+      AbsTime m = (t[i] + beat / 2) / beat;
+      AbsTime grid = m * beat;
+      AbsTime off = t[i] > grid ? t[i] - grid : grid - t[i];
+      if (off < beat / 6) {
+        line.sumMT += uint64_t(m) * t[i];
+        line.sumMM += uint64_t(m) * m;
+      }
+    }
+    return line;
+  }
+
+  AbsTime refine(const AbsTime* t, uint16_t n, AbsTime beat) {
+    for (int pass = 0; pass < 2; ++pass) {
+      Line line = fitLine(t, n, beat);
+      if (line.sumMM == 0)
+        break;
+      beat = AbsTime((line.sumMT + line.sumMM / 2) / line.sumMM);
+    }
+    return beat;
+  }
+
+  int32_t gridScore(const AbsTime* t, uint16_t n, AbsTime beat) {
+    // beats of the grid with an onset on them, less those without, which
+    // count for more, so a grid must be two thirds full to score at all
+    int32_t hit = 0;
+    AbsTime lastHit = 0xffffffff;
+    for (uint16_t i = 0; i < n; ++i) {
+      AbsTime m = (t[i] + beat / 2) / beat;
+      AbsTime grid = m * beat;
+      AbsTime off = t[i] > grid ? t[i] - grid : grid - t[i];
+      if (off < beat / 6 && m != lastHit) {
+        hit += 1;
+        lastHit = m;
+      }
+    }
+    int32_t beats = (t[n - 1] + beat / 2) / beat + 1;
+    return 3 * hit - 2 * beats;
+  }
+
+  AbsTime nearestBeats(AbsTime length, AbsTime beat) {
+    return (length + beat / 2) / beat * beat;
+  }
+
+  AbsTime apart(AbsTime a, AbsTime b) {
+    return a > b ? a - b : b - a;
+  }
+}
+
+
+AbsTime fitLoopLength(const AbsTime* onsets, uint16_t count, AbsTime length) {
+  AbsTime t[maxOnsets];
+  uint16_t n = 0;
+  for (uint16_t i = 0; i < count && n < maxOnsets; ++i)
+    if (n == 0 || onsets[i] - t[n - 1] >= chordWidth)
+      t[n++] = onsets[i];
+
+  if (n < 4 || length < 2 * minBeat)
+    return length;
+
+  uint8_t hist[binCount] = { };
+  for (uint16_t i = 0; i < n; ++i) {
+    for (uint16_t j = i + 1; j < n; ++j) {
+      AbsTime b = (t[j] - t[i] + binWidth / 2) / binWidth;
+      if (b >= binCount) break;
+        // onsets are in order, so the rest are further still
+      if (hist[b] < 255) hist[b] += 1;
+    }
+  }
+
+  uint16_t best = 0;
+  uint16_t bestScore = 0;
+  for (uint16_t b = maxBeat / binWidth; b >= minBeat / binWidth; --b) {
+    uint16_t s = score(hist, b);
+    if (s > bestScore) {
+      best = b;
+      bestScore = s;
+    }
+  }
+    // from the longest down, so a tie goes to the longer beat
+
+  if (bestScore < n)
+    return length;
+    // fewer than one pair per onset isn't a beat
+
+  // The histogram is easily fooled by off beats into a beat half, or one and
+  // a half, times too long or short, so those are tried too, each refined,
+  // and the one whose grid best fits the onsets wins.
+  const AbsTime rough = best * binWidth;
+  const AbsTime tries[] = {
+    rough, rough / 2, rough * 2, rough * 2 / 3, rough * 3 / 2 };
+
+  AbsTime tried[5];
+  int32_t triedScore[5];
+  uint16_t triedCount = 0;
+
+  AbsTime beat = 0;
+  int32_t beatScore = 0;
+  for (AbsTime r : tries) {
+    if (r < minBeat || r > maxBeat) continue;
+    AbsTime b = refine(t, n, r);
+    if (b < minBeat || b > maxBeat) continue;
+    int32_t s = gridScore(t, n, b);
+    tried[triedCount] = b;
+    triedScore[triedCount] = s;
+    triedCount += 1;
+    if (beat == 0 || s > beatScore) {
+      beat = b;
+      beatScore = s;
+    }
+  }
+
+  if (beat == 0 || beatScore <= 0)
+    return length;
+
+  AbsTime beats = (length + beat / 2) / beat;
+  if (beats < 2)
+    return length;
+  const AbsTime fit = beats * beat;
+
+  // A wrong beat is worse than none: the loop would be cut, or padded, by
+  // half a beat or more. So if any beat that scores near the winner, among
+  // those tried, or half, two thirds, one and a half, or twice the winner,
+  // would make the loop a different length, it is left as pressed.
+  for (uint16_t i = 0; i < triedCount; ++i)
+    if (triedScore[i] >= beatScore - rivalMargin
+        && apart(nearestBeats(length, tried[i]), fit) > fitTolerance)
+      return length;
+
+  const AbsTime rivals[] = { beat / 2, beat * 2 / 3, beat * 3 / 2, beat * 2 };
+  for (AbsTime r : rivals) {
+    if (r < minBeat / 2 || r > maxBeat * 2) continue;
+    AbsTime b = refine(t, n, r);
+    if (b == 0) continue;
+    if (gridScore(t, n, b) >= beatScore - rivalMargin
+        && apart(nearestBeats(length, b), fit) > fitTolerance)
+      return length;
+  }
+
+  if (apart(fit, length) > beat / 4)
+    return length;
+    // further than keep is pressed off the beat, so more likely a wrong beat
+
+  // The length is taken from the fitted line itself, not the whole ms beat,
+  // which over a long loop would add up to more than the tolerance.
+  Line line = fitLine(t, n, beat);
+  if (line.sumMM == 0)
+    return fit;
+  return AbsTime((beats * line.sumMT + line.sumMM / 2) / line.sumMM);
+}
+
+
+#if defined(BICYCLE_BEATFIT_MAIN)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+
+namespace {
+  class Random {
+  public:
+    Random(uint32_t seed) : s(seed ? seed : 1) { }
+    uint32_t next() {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      return s;
+    }
+    uint32_t below(uint32_t n) { return next() % n; }
+  private:
+    uint32_t s;
+  };
+}
+
+int main(int argc, char* argv[]) {
+  unsigned long runs = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 10000;
+  uint32_t seed = argc > 2 ? std::strtoul(argv[2], nullptr, 0) : 1;
+
+  Random rand(seed);
+  unsigned long fitted = 0, unchanged = 0, wrong = 0;
+  double totalNs = 0, mostNs = 0;
+
+  for (unsigned long r = 0; r < runs; ++r) {
+    // a made up performance: a few bars at some tempo, with notes on most
+    // beats, some off beats and chords, played a little unevenly, and keep
+    // pressed up to a third of a beat early or late
+    AbsTime beat = minBeat + 20 + rand.below(maxBeat - minBeat - 70);
+    AbsTime beats = 4 * (1 + rand.below(4));
+    AbsTime length = beats * beat;
+    AbsTime pressed = length - beat / 3 + rand.below(2 * beat / 3);
+
+    AbsTime onsets[maxOnsets];
+    uint16_t count = 0;
+    auto play = [&](AbsTime at) {
+      AbsTime jittered = at ? at + rand.below(25) - 12 : 0;
+      if (count < maxOnsets && jittered < pressed)
+        onsets[count++] = jittered;
+    };
+    for (AbsTime b = 0; b < beats + 1; ++b) {
+      if (b == 0 || rand.below(10) < 8) {
+        play(b * beat);
+        if (rand.below(10) < 3) play(b * beat + 5);
+      }
+      if (rand.below(10) < 3) play(b * beat + beat / 2);
+    }
+    std::sort(onsets, onsets + count);
+
+    auto start = std::chrono::steady_clock::now();
+    AbsTime fit = fitLoopLength(onsets, count, pressed);
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    totalNs += ns;
+    mostNs = std::max(mostNs, ns);
+
+    AbsTime off = fit > length ? fit - length : length - fit;
+    if (fit == pressed)           unchanged += 1;
+    else if (off <= fitTolerance) fitted += 1;
+    else                          wrong += 1;
+  }
+
+  std::printf("%lu performances: %lu fitted, %lu left as pressed, %lu wrong\n",
+    runs, fitted, unchanged, wrong);
+  std::printf("%.1f us per fit, %.1f us at most\n",
+    totalNs / runs / 1000, mostNs / 1000);
+  std::printf("%s\n", wrong == 0 ? "ok" : "FAILED");
+  return wrong == 0 ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _INCLUDE_BEATFIT_H_
+#define _INCLUDE_BEATFIT_H_
+
+#include <cstdint>
+
+#include "types.h"
+
+
+/**
+***  Beat Fitting
+**/
+
+// When the first pass of a loop is closed, keep() is rarely pressed exactly
+// on the beat. Given the onsets of the notes played, in order, from the start
+// of the loop, this estimates the beat, and returns the whole number of beats
+// nearest to the length pressed, which can be up to a quarter of a beat
+// shorter or longer. If the onsets show no clear beat, or could as well fit
+// a beat half, or one and a half, times as long or short, or the nearest
+// whole number of beats is further than that from the length pressed, the
+// length is returned unchanged.
+//
+// The beat is found by autocorrelation: every pair of onsets less than three
+// beats apart is counted into a histogram of the time between them, and each
+// beat in range is scored by the counts at one, two, and three times it. The
+// best, and its simple ratios, are then fitted to the onsets themselves.
+// It is all integer arithmetic, in bounded time: with maxOnsets, about 2000
+// pairs, 100 scores, and about 30 passes over the onsets, well within a tick.
+
+const uint16_t maxOnsets = 64;    // any past these are ignored
+const AbsTime minBeat = 250;      // 240 bpm
+const AbsTime maxBeat = 1200;     // 50 bpm
+
+AbsTime fitLoopLength(const AbsTime* onsets, uint16_t count, AbsTime length);
+
+
+// Build with:  g++ -O2 -DBICYCLE_BEATFIT_MAIN beatfit.cpp
+// to time it, and check how well it fits, on made up performances
+
+#endif // _INCLUDE_BEATFIT_H_
@@ -2,9 +2,15 @@
 #include <Adafruit_TinyUSB.h>
 
 #include "analog.h"
+#include "controls.h"
 #include "display.h"
+#include "eventlog.h"
 #include "looper.h"
+#include "midiout.h"
+#include "persist.h"
+#include "transfer.h"
 #include "types.h"
+#include "usbmidi.h"
 
 
 // USB MIDI object
@@ -36,6 +42,11 @@ inline float mapMidiToCV(uint8_t val) {
   return val / (127.0f / 2) - 1;
 }
 
+inline MidiRoute mapMidiToRoute(uint8_t val) {
+  // thirds of the range: USB, DIN, both
+  return MidiRoute(1 + val * 3 / 128);
+}
+
 void playTrigger(uint8_t note, bool on, uint8_t vel) {
   int t;
 
@@ -51,7 +62,7 @@ void playTrigger(uint8_t note, bool on, uint8_t vel) {
   if (on && (t == 1 || t == 2)) {    // only trigs 1 & 2 have c.v. out
     cvOut(t, mapMidiToCV(vel));
   }
-  trigOut(t, on);
+  trigNote(t, on);
 }
 
 void playCv(uint8_t cc, uint8_t val) {
@@ -67,133 +78,141 @@ void playCv(uint8_t cc, uint8_t val) {
   cvOut(t, mapMidiToCV(val));
 }
 
-void playEvent(const MidiEvent& ev) {
-  uint8_t packet[4];
+extern Loop theLoop;
 
+void playEvent(const MidiEvent& ev) {
   if (ev.isNoteOff())       playTrigger(ev.data1, false, ev.data2);
   else if (ev.isNoteOn())   playTrigger(ev.data1, true,  ev.data2);
   else if (ev.isCC())       playCv(ev.data1, ev.data2);
 
 
-  packet[0] = 0 | (ev.status >> 4);
-    // TODO: This works because of the limited range of things the
-    // noteEvent() accepts into the looper... but this should be
-    // fixed support all messages just to be safe.
-  packet[1] = ev.status;
-  packet[2] = ev.data1;
-  packet[3] = ev.data2;
-
-  usb_midi.send(packet);
+  midiOutSend(ev, theLoop.layer());
+  logMidi(logMidiOut, ev);
 }
 
 Loop theLoop(playEvent);
 
 
-void controlEvent(const MidiEvent& ev) {
-  // Currently set up for the nanoKontrol default
-
-  switch (ev.status & 0xf0) {
-    case 0xb0: // CC
-      switch (ev.data1) {
-        case   2: theLoop.layerVolume(0, ev.data2); break;
-        case   3: theLoop.layerVolume(1, ev.data2); break;
-        case   4: theLoop.layerVolume(2, ev.data2); break;
-        case   5: theLoop.layerVolume(3, ev.data2); break;
-        case   6: theLoop.layerVolume(4, ev.data2); break;
-        case   8: theLoop.layerVolume(5, ev.data2); break;
-        case   9: theLoop.layerVolume(6, ev.data2); break;
-        case  11: theLoop.layerVolume(7, ev.data2); break;
-        case  12: theLoop.layerVolume(8, ev.data2); break;
-          // yes, CCs 7, 10, & 11 are skipped
-
-        // knobs for testing the CV output
-        case  14: cvOut(0, mapMidiToCV(ev.data2)); break;
-        case  15: cvOut(1, mapMidiToCV(ev.data2)); break;
-        case  16: cvOut(2, mapMidiToCV(ev.data2)); break;
-        case  17: cvOut(3, mapMidiToCV(ev.data2)); break;
-
-        case  23: theLoop.layerMute(0, ev.data2 != 0); break;
-        case  24: theLoop.layerMute(1, ev.data2 != 0); break;
-        case  25: theLoop.layerMute(2, ev.data2 != 0); break;
-        case  26: theLoop.layerMute(3, ev.data2 != 0); break;
-        case  27: theLoop.layerMute(4, ev.data2 != 0); break;
-        case  28: theLoop.layerMute(5, ev.data2 != 0); break;
-        case  29: theLoop.layerMute(6, ev.data2 != 0); break;
-        case  30: theLoop.layerMute(7, ev.data2 != 0); break;
-        case  31: theLoop.layerMute(8, ev.data2 != 0); break;
-
-        case  33: if (ev.data2) theLoop.layerArm(0); break;
-        case  34: if (ev.data2) theLoop.layerArm(1); break;
-        case  35: if (ev.data2) theLoop.layerArm(2); break;
-        case  36: if (ev.data2) theLoop.layerArm(3); break;
-        case  37: if (ev.data2) theLoop.layerArm(4); break;
-        case  38: if (ev.data2) theLoop.layerArm(5); break;
-        case  39: if (ev.data2) theLoop.layerArm(6); break;
-        case  40: if (ev.data2) theLoop.layerArm(7); break;
-        case  41: if (ev.data2) theLoop.layerArm(8); break;
-
-        case  44:  if (ev.data2) theLoop.arm();    break;
-        case  46:  if (ev.data2) theLoop.clear();  break;
-        case  49:  if (ev.data2) theLoop.keep();   break;
-
-      }
+void noteEvent(const MidiEvent& ev) {
+  ControlBinding b = controlLookup(ev);
+  uint8_t v = controlValue(ev);
+
+  logMidi(logMidiIn, ev);
+  if (b.action != actionRecord && b.action != actionIgnore)
+    logEvent(logAction, b.action, b.arg, v);
+
+  switch (b.action) {
+    case actionRecord:      theLoop.addEvent(ev);                   break;
+
+    case actionLayerVolume: theLoop.layerVolume(b.arg, v);          break;
+    case actionLayerMute:   theLoop.layerMute(b.arg, v != 0);       break;
+    case actionCvOut:       cvOut(b.arg, mapMidiToCV(v));           break;
+
+    case actionLfoRate:     lfoRate(b.arg, v);                      break;
+    case actionLfoDepth:    lfoDepth(b.arg, v);                     break;
+    case actionLfoShape:    lfoShape(b.arg, v);                     break;
+    case actionLfoSync:     lfoSync(b.arg, v);                      break;
+
+    case actionCvGlide:     cvGlide(b.arg, v);                      break;
+    case actionCvGlideMode: cvGlideMode(b.arg, v);                  break;
+    case actionTrigWidth:   trigWidth(b.arg, v);                    break;
+
+    case actionLayerCurve:      theLoop.layerCurve(b.arg, v - 64);      break;
+    case actionLayerTranspose:  theLoop.layerTranspose(b.arg, v - 64);  break;
+    case actionLayerChannel:
+      // the bottom of the range leaves the channel as played
+      theLoop.layerChannel(b.arg,
+        v < 8 ? Loop::keepChannel : (v - 8) * 16 / 120);
+      break;
+    case actionLayerLowNote:    theLoop.layerLowNote(b.arg, v);         break;
+    case actionLayerHighNote:   theLoop.layerHighNote(b.arg, v);        break;
+
+    case actionLayerRoute:    midiRouteLayer(b.arg, mapMidiToRoute(v));   break;
+    case actionChannelRoute:  midiRouteChannel(b.arg, mapMidiToRoute(v)); break;
+    case actionSystemRoute:   midiRouteSystem(mapMidiToRoute(v));         break;
+
+    case actionCvInMode:    cvInMode(b.arg, v);                     break;
+  }
+
+  if (!v) return;
+
+  switch (b.action) {
+    case actionLayerArm:    theLoop.layerArm(b.arg);                break;
+    case actionArm:         theLoop.arm();                          break;
+    case actionClear:       theLoop.clear();                        break;
+    case actionKeep:        theLoop.keep();                         break;
+    case actionOverdub:
+      theLoop.overdub(!theLoop.status().overdubbing);
+      break;
+    case actionAutoLength:
+      theLoop.autoLength(!theLoop.status().autoLength);
       break;
+    case actionSceneRecall: theLoop.sceneRecall(b.arg);             break;
+    case actionSceneStore:  theLoop.sceneStore(b.arg);              break;
+    case actionProfile:     controlProfile(b.arg);                  break;
+    case actionLearn:       controlLearn();                         break;
   }
 }
 
-void noteEvent(const MidiEvent& ev) {
-  auto ch = ev.status & 0x0f;
-  if (ch == 0x0f) {
-    controlEvent(ev);
-    return;
-  }
+uint8_t heldPacket[4];
+bool holdingPacket = false;
+  // a pass through packet that couldn't be sent yet
 
-  if (ch == 0x01) {
-    if ((ev.status & 0xf0) == 0x90) {
-      switch (ev.data1) {
-        case noteUpperLeft:   theLoop.keep(); break;
-        case noteUpperRight:  theLoop.arm();  break;
-      }
-    }
+void notePacket(const uint8_t packet[4]) {
+  if (usbMidiIsSysEx(packet) || packet[1] >= 0xf0) {
+    // SysEx, system common, and realtime messages all pass through, a
+    // packet at a time, so patch dumps are never buffered whole. They go in
+    // the same queue as what the loop plays, so neither overtakes the other.
+    for (int i = 0; i < 4; ++i)
+      heldPacket[i] = packet[i];
+    holdingPacket = !midiOutPassThrough(heldPacket);
+      // if the output is full, hold it, and stop reading input until it
+      // goes, which holds off the sender rather than losing bytes
     return;
   }
 
-  switch (ev.status & 0xf0) {
-    case 0x80: // Note Off
-    case 0x90: // Note On
-    case 0xa0: // Poly Aftertouch
-      break;
+  noteEvent(usbMidiDecode(packet));
+}
 
-    case 0xb0: // CC
-      switch (ev.data1) {
-        case 64:  if (ev.data2) theLoop.keep();   return;
-          // treat the sustain pedal as the keep function
-      }
-      break;
 
-    case 0xc0: // Program change
-      return;     // TODO: echo these?
 
-    case 0xd0: // Channel Aftertouch
-    case 0xe0: // Pitch Bend
-      break;
+void logStatus(const Loop::Status& s) {
+  static Loop::Status logged = { };
 
-    case 0xf0: // System Messages
-      return;
+  auto logField = [](LogStateField f, uint16_t v) {
+    logEvent(logState, f, uint8_t(v), uint8_t(v >> 8));
+  };
 
-    default:
-      return;
-  }
+  if (s.looping != logged.looping)
+    logField(stateLooping, s.looping);
+  if (s.looping && s.length != logged.length)
+    logField(stateLength, s.length / 10);
+  if (s.activeLayer != logged.activeLayer)
+    logField(stateActiveLayer, s.activeLayer);
+  if (s.scene != logged.scene)
+    logField(stateScene, s.scene);
 
-  theLoop.addEvent(ev);
+  logged = s;
 }
 
-void notePacket(const uint8_t packet[4]) {
-  MidiEvent ev;
-  ev.status = packet[1];
-  ev.data1 = packet[2];
-  ev.data2 = packet[3];
-  noteEvent(ev);
+void logPorts() {
+  static uint16_t logged[portCount] = { };
+
+  for (int p = 0; p < portCount; ++p) {
+    MidiPortStats st = midiOutStats(MidiPort(p));
+    if (st.dropped != logged[p]) {
+      logValue(p == portUsb ? "USB MIDI out dropped" : "DIN MIDI out dropped",
+        st.dropped);
+      logged[p] = st.dropped;
+    }
+  }
+
+  static uint16_t loggedOverruns = 0;
+  uint16_t overruns = cvInOverruns();
+  if (overruns != loggedOverruns) {
+    logValue("c.v. in blocks lost", overruns);
+    loggedOverruns = overruns;
+  }
 }
 
 
@@ -205,10 +224,13 @@ void setup() {
   // while (!Serial);
 
   analogBegin();
+  persistBegin();
+  controlsBegin();
 
   theLoop.begin();
 
   usb_midi.begin();
+  midiOutBegin();
   //while (!USBDevice.mounted()) delay(1);
 
   // force USB reconnect so MIDI port will be re-found
@@ -216,8 +238,11 @@ void setup() {
   delay(3000);
   USBDevice.attach();
 
+  theLoop.advance(millis());
+  if (persistRestore(theLoop))
+    logMessage("Restored saved loop");
 
-  Serial.println("Ready!");
+  logMessage("Ready!");
 }
 
 void loop() {
@@ -229,19 +254,40 @@ void loop() {
     then = now;
   }
 
+  midiOutUpdate();
+  if (holdingPacket)
+    holdingPacket = !midiOutPassThrough(heldPacket);
+
   uint8_t packet[4];
-  while (usb_midi.receive(packet)) {
+  while (!holdingPacket && usb_midi.receive(packet)) {
     notePacket(packet);
   }
 
-  // analogUpdate(now);
+  analogUpdate(now);
+  MidiEvent cvEvent;
+  while (cvInEvent(cvEvent)) {
+    logMidi(logMidiIn, cvEvent);
+    theLoop.addEvent(cvEvent);
+  }
+  persistUpdate(now);
+  controlsUpdate(now);
+  transferUpdate(now, theLoop);
 
   Loop::Status s = theLoop.status();
+  if (s.looping)
+    lfoLoop(s.length, s.position);
+  logStatus(s);
+  logPorts();
   displayUpdate(now, s);
+
+  if (!transferBusy())
+    logUpdate();
 }
 
 
 void buttonActionA() { toggleTestWave(); }
+void buttonActionB() { persistSave(theLoop); }
+void buttonActionC() { controlLearn(); }
 
 
 
@@ -1,39 +1,184 @@
 #include "cell.h"
 
+#if defined(__ARM_ARCH_6M__)
+#include <Arduino.h>    // for the CMSIS PRIMASK functions
+#else
+#include <atomic>
+#endif
+
+
+// Cells can be allocated and freed from both the main loop and interrupts.
+//
+// The free list head is a single 32 bit word: the index of the first free
+// cell in the low half, and a tag in the high half. The tag is bumped on
+// every change, so a head read before an interrupt popped and pushed cells
+// can't compare equal after it (the ABA problem). Each operation reads the
+// head, works out the new one, and swaps it in only if the head is unchanged,
+// otherwise it tries again.
 
 namespace {
   bool      storageInitialized = false;
-  CellIndex freeIndex;
+
+  typedef uint32_t FreeHead;
+
+  inline FreeHead makeHead(CellIndex i, uint16_t tag)
+    { return static_cast<uint32_t>(tag) << 16 | i; }
+  inline CellIndex headIndex(FreeHead h) { return h & 0xffff; }
+  inline uint16_t headTag(FreeHead h) { return h >> 16; }
+
+#if defined(__ARM_ARCH_6M__)
+  // Cortex-M0+ has no exclusive access instructions, so the compare and swap
+  // is done with interrupts masked, for just the few instructions it takes.
+
+  volatile FreeHead freeHead;
+
+  inline FreeHead loadHead() { return freeHead; }
+
+  inline bool swapHead(FreeHead& expected, FreeHead desired) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    bool swapped = freeHead == expected;
+    if (swapped)  freeHead = desired;
+    else          expected = freeHead;
+    __set_PRIMASK(primask);
+    return swapped;
+  }
+
+  volatile uint16_t freeCells;
+
+  inline void adjustFree(int16_t d) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    freeCells += d;
+    __set_PRIMASK(primask);
+  }
+#else
+  // Cortex-M4 (and the host) can do it lock free.
+
+  std::atomic<FreeHead> freeHead;
+
+  inline FreeHead loadHead()
+    { return freeHead.load(std::memory_order_acquire); }
+
+  inline bool swapHead(FreeHead& expected, FreeHead desired) {
+    return freeHead.compare_exchange_weak(expected, desired,
+      std::memory_order_acq_rel, std::memory_order_acquire);
+  }
+
+  std::atomic<uint16_t> freeCells;
+
+  inline void adjustFree(int16_t d)
+    { freeCells.fetch_add(d, std::memory_order_relaxed); }
+#endif
+
+  // A cell's link is read in alloc() while another context may be taking
+  // that same cell, and the statistics are bumped from anywhere, so both are
+  // read and written as relaxed atomics. On the chips these are just plain
+  // loads and stores, but on the host, where the allocator is tested with
+  // threads, the races are then well defined.
+
+  template<typename T>
+  inline T loadRelaxed(const T& v)
+    { return __atomic_load_n(&v, __ATOMIC_RELAXED); }
+  template<typename T>
+  inline void storeRelaxed(T& v, T x)
+    { __atomic_store_n(&v, x, __ATOMIC_RELAXED); }
+
+  // The count of free cells is kept apart from the head, so checking it
+  // against a reserve can be off by an interrupt's worth of allocations.
+  // That's fine: the reserves are headroom, not exact limits. The failure
+  // counts, and the fewest free, are only statistics, and likewise not exact.
+
+  uint16_t reserves[Cell::priorityCount] = { 0, 32, 128 };
+  uint16_t failed[Cell::priorityCount] = { 0, 0, 0 };
+  uint16_t fewestFree;
+
+  inline void countFailure(Cell::Priority p) {
+    uint16_t n = loadRelaxed(failed[p]);
+    storeRelaxed(failed[p], static_cast<uint16_t>(n + 1));
+  }
 }
 
-Cell Cell::storage[2000];
+Cell Cell::storage[config.cells];
 
 
 void Cell::begin() {
   if (storageInitialized) return;
 
-  freeIndex = nullIndex;
+  CellIndex first = nullIndex;
   for (CellIndex i = 0; i < sizeof(storage)/sizeof(storage[0]); ++i) {
-    storage[i].nextCell = freeIndex;
-    freeIndex = i;
+    storage[i].nextCell = first;
+    first = i;
   }
+  freeHead = makeHead(first, 0);
+  freeCells = sizeof(storage)/sizeof(storage[0]);
+  fewestFree = freeCells;
 
   storageInitialized = true;
 }
 
 
-Cell* Cell::alloc() {
-  if (freeIndex == nullIndex) return nullptr;
+Cell* Cell::alloc(Priority p) {
+  if (freeCells <= reserves[p]) {
+    countFailure(p);
+    return nullptr;
+  }
+
+  FreeHead head = loadHead();
+  Cell* c;
 
-  Cell* c = &storage[freeIndex];
-  freeIndex = c->nextCell;
-  c->nextCell = nullIndex;
+  do {
+    if (headIndex(head) == nullIndex) {
+      countFailure(p);
+      return nullptr;
+    }
+    c = &storage[headIndex(head)];
+  } while (!swapHead(head,
+              makeHead(loadRelaxed(c->nextCell), headTag(head) + 1)));
+    // if c was taken in the meantime, c->nextCell may be junk, but then the
+    // tag will have changed, and the swap will fail
+
+  adjustFree(-1);
+  uint16_t f = freeCells;
+  if (f < loadRelaxed(fewestFree)) storeRelaxed(fewestFree, f);
+
+  storeRelaxed(c->nextCell, nullIndex);
   return c;
 }
 
 void Cell::free() {
-  this->nextCell = freeIndex;
-  freeIndex = this - storage;
+  CellIndex i = this - storage;
+  FreeHead head = loadHead();
+
+  do {
+    storeRelaxed(this->nextCell, headIndex(head));
+  } while (!swapHead(head, makeHead(i, headTag(head) + 1)));
+  adjustFree(1);
+}
+
+
+void Cell::reserve(Priority p, uint16_t n) {
+  reserves[p] = n;
+}
+
+uint16_t Cell::reserved(Priority p) {
+  return reserves[p];
+}
+
+uint16_t Cell::capacity() {
+  return sizeof(storage)/sizeof(storage[0]);
+}
+
+uint16_t Cell::freeCount() {
+  return freeCells;
+}
+
+uint16_t Cell::mostUsed() {
+  return capacity() - loadRelaxed(fewestFree);
+}
+
+uint16_t Cell::failures(Priority p) {
+  return loadRelaxed(failed[p]);
 }
 
 
@@ -44,3 +189,132 @@ Cell* Cell::next() const {
 void Cell::link(Cell* newNext) {
   nextCell = newNext ? newNext - storage : nullIndex;
 }
+
+
+
+#if defined(BICYCLE_CELL_MAIN)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+
+namespace {
+  class Random {
+  public:
+    Random(uint32_t seed) : s(seed ? seed : 1) { }
+    uint32_t next() {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      return s;
+    }
+    uint32_t below(uint32_t n) { return next() % n; }
+  private:
+    uint32_t s;
+  };
+
+  struct Tally {
+    unsigned long allocs = 0;
+    unsigned long empty = 0;      // times the pool ran dry
+    unsigned long doubled = 0;    // cells handed out while held
+    unsigned long trampled = 0;   // cells changed while held
+  };
+
+  void churn(uint8_t id, unsigned long rounds, size_t most, uint32_t seed,
+      Tally& t) {
+    // Takes runs of cells, marks each as held by this thread in its layer,
+    // and stamps the rest of it, then checks the stamps are unchanged, and
+    // frees them in a shuffled order. With long runs, the threads between
+    // them ask for more cells than there are, so the pool is often empty.
+    // With short ones, the same few cells go round and round, and are at
+    // the head of the list again and again, as the tags must catch.
+    Random rand(seed);
+    std::vector<Cell*> held;
+
+    for (unsigned long r = 0; r < rounds; ++r) {
+      size_t want = 1 + rand.below(uint32_t(most));
+      while (held.size() < want) {
+        Cell* c = Cell::alloc(Cell::priorityOff);
+        if (!c) {
+          t.empty += 1;
+          break;
+        }
+        t.allocs += 1;
+        if (__atomic_exchange_n(&c->layer, id, __ATOMIC_RELAXED) != 0)
+          t.doubled += 1;
+        c->event = { id, uint8_t(r), uint8_t(held.size()) };
+        c->duration = DeltaTime(r);
+        c->nextTime = DeltaTime(held.size());
+        held.push_back(c);
+      }
+
+      for (size_t i = 0; i < held.size(); ++i) {
+        const Cell* c = held[i];
+        if (c->event.status != id || c->event.data1 != uint8_t(r)
+            || c->event.data2 != uint8_t(i) || c->duration != DeltaTime(r)
+            || c->nextTime != DeltaTime(i))
+          t.trampled += 1;
+      }
+
+      for (size_t i = held.size(); i > 1; --i)
+        std::swap(held[i - 1], held[rand.below(uint32_t(i))]);
+      for (Cell* c : held) {
+        __atomic_store_n(&c->layer, uint8_t(0), __ATOMIC_RELAXED);
+        c->free();
+      }
+      held.clear();
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  unsigned threads = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 4;
+  unsigned long rounds = argc > 2 ? std::strtoul(argv[2], nullptr, 0) : 20000;
+  size_t most = argc > 3 ? std::strtoul(argv[3], nullptr, 0) : config.cells / 2;
+  uint32_t seed = argc > 4 ? std::strtoul(argv[4], nullptr, 0) : 1;
+
+  if (threads < 1 || threads > 254 || most < 1) {
+    std::fprintf(stderr, "usage: %s [threads [rounds [most [seed]]]]\n",
+      argv[0]);
+    return 2;
+  }
+
+  Cell::begin();
+  for (int p = 0; p < Cell::priorityCount; ++p)
+    Cell::reserve(Cell::Priority(p), 0);
+
+  std::vector<Tally> tallies(threads);
+  std::vector<std::thread> running;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < threads; ++i)
+    running.emplace_back(churn, uint8_t(i + 1), rounds, most, seed + i,
+      std::ref(tallies[i]));
+  for (auto& th : running)
+    th.join();
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+
+  Tally total;
+  for (auto& t : tallies) {
+    total.allocs += t.allocs;
+    total.empty += t.empty;
+    total.doubled += t.doubled;
+    total.trampled += t.trampled;
+  }
+
+  bool ok = total.doubled == 0 && total.trampled == 0
+    && Cell::freeCount() == Cell::capacity();
+
+  std::printf("%u threads, %lu allocations, pool empty %lu times, in %.2f s\n",
+    threads, total.allocs, total.empty, took.count());
+  std::printf("%lu handed out twice, %lu changed while held\n",
+    total.doubled, total.trampled);
+  std::printf("%u of %u cells free at the end\n",
+    unsigned(Cell::freeCount()), unsigned(Cell::capacity()));
+  std::printf("%s\n", ok ? "ok" : "FAILED");
+  return ok ? 0 : 1;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef _INCLUDE_CELL_H_
 #define _INCLUDE_CELL_H_
 
+#include "config.h"
 #include "types.h"
 
 typedef uint16_t CellIndex;
@@ -18,9 +19,25 @@ private:
   CellIndex   nextCell;
 
 public:
-  static Cell* alloc();
+  enum Priority : uint8_t {
+    priorityOff,        // NoteOffs for notes being played
+    priorityRecord,     // newly recorded notes
+    priorityControl,    // newly recorded CCs and other control data
+    priorityCount
+  };
+
+  static Cell* alloc(Priority);
+    // fails if it would leave fewer free cells than reserved for the priority
   void free();
 
+  static void reserve(Priority, uint16_t);
+    // how many cells must be left free for higher priority uses
+  static uint16_t reserved(Priority);
+  static uint16_t capacity();
+  static uint16_t freeCount();
+  static uint16_t mostUsed();           // the most ever in use at once
+  static uint16_t failures(Priority);   // allocations that failed, per priority
+
   bool atEnd() const { return nextCell == nullIndex; }
 
   Cell* next() const;
@@ -31,7 +48,12 @@ public:
 private:
   Cell() { };
 
-  static Cell storage[2000];
+  static Cell storage[config.cells];
 };
 
+
+// Build with:  g++ -O2 -pthread -DBICYCLE_CELL_MAIN cell.cpp
+// to stress the allocator from threads, and with -fsanitize=thread to check
+// it for races
+
 #endif // _INCLUDE_CELL_H_
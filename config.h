@@ -0,0 +1,44 @@
+#ifndef _INCLUDE_CONFIG_H_
+#define _INCLUDE_CONFIG_H_
+
+#include <cstdint>
+
+
+/**
+***  Build Configuration
+**/
+
+// The sizes of things that are fixed when the sketch is built, chosen for the
+// board it is built for. Everything sized by these is sized exactly, so loops
+// over layers and tables have constant bounds.
+
+struct Config {
+  uint8_t   layers;       // at most 16, layer enables are a bit per layer
+  uint16_t  cells;        // the cell pool, see cell.h
+  uint8_t   noteSlots;    // entries in each table of held notes: a power
+                          // of two, about twice the polyphony expected
+  bool      dinMidi;      // MIDI out of Serial1's TX pin, which otherwise
+                          // is trigger output 2, see analog.cpp
+  bool      cvIn;         // sample the spare analog pins as c.v. inputs,
+                          // see analog.h
+};
+
+
+#if defined(__SAMD51__)
+constexpr Config config = { 16, 7000, 64, false, false };
+#elif defined(ARDUINO)
+constexpr Config config = { 4, 2000, 32, false, false };
+  // SAMD21: 32k of RAM, most of which is the cell pool
+#else
+constexpr Config config = { 9, 2000, 32, false, false };
+  // host builds, for tools and simulation
+#endif
+
+static_assert(config.layers > 0 && config.layers <= 16,
+  "layer enables are a bit per layer");
+static_assert(config.cells < 0xffff, "cells are indexed by 16 bits");
+static_assert((config.noteSlots & (config.noteSlots - 1)) == 0,
+  "note tables must be a power of two");
+
+
+#endif // _INCLUDE_CONFIG_H_
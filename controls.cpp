@@ -0,0 +1,282 @@
+#include "controls.h"
+
+#include "analog.h"
+#include "config.h"
+#include "eventlog.h"
+#include "persist.h"
+
+
+namespace {
+
+  // Pages hold the bindings for all 128 notes, or CCs, on one channel.
+  // Channels share pages, and most channels have none.
+
+  const uint8_t pageCount = 6;
+  const uint8_t noPage = 0xff;
+
+  enum Kind : uint8_t { kindNote, kindCC, kindCount, kindNone = 0xff };
+
+  const Kind kinds[16] = {
+    kindNone, kindNone, kindNone, kindNone, kindNone, kindNone, kindNone,
+    kindNone,
+    kindNote, kindNote,   // Note Off, Note On
+    kindNone,             // Poly Aftertouch
+    kindCC,
+    kindNone, kindNone, kindNone, kindNone,
+  };
+
+  struct Profile {
+    uint8_t channelPage[16][kindCount];
+    uint8_t omniPage[kindCount];
+    uint16_t ignoredChannels;
+    ControlBinding pages[pageCount][128];
+  };
+
+  Profile profile;
+  uint8_t currentProfile = 0;
+  uint8_t pendingProfile = 0;
+  bool dirty = false;       // has bindings not yet saved
+
+
+  void bind(uint8_t page, uint8_t number, ControlAction action, uint8_t arg = 0)
+    { profile.pages[page][number] = { action, arg }; }
+
+  void defaultProfile() {
+    for (auto& c : profile.channelPage)
+      for (auto& p : c) p = noPage;
+    for (auto& p : profile.omniPage) p = noPage;
+    profile.ignoredChannels = 0;
+    for (auto& page : profile.pages)
+      for (auto& b : page) b = { actionDefault, 0 };
+
+    // page 0: the nanoKONTROL default, on channel 16
+    profile.channelPage[15][kindCC] = 0;
+    profile.ignoredChannels |= 1 << 15;
+
+    const uint8_t volumeCCs[] = { 2, 3, 4, 5, 6, 8, 9, 11, 12 };
+      // yes, CCs 7 & 10 are skipped
+    for (uint8_t i = 0; i < 9 && i < config.layers; ++i) {
+      bind(0, volumeCCs[i],   actionLayerVolume,  i);
+      bind(0, 23 + i,         actionLayerMute,    i);
+      bind(0, 33 + i,         actionLayerArm,     i);
+    }
+    for (uint8_t i = 0; i < 4; ++i) {
+      bind(0, 14 + i, actionCvOut, i);    // knobs for testing the CV output
+      bind(0, 51 + i, actionSceneRecall, i);
+      bind(0, 55 + i, actionSceneStore, i);
+
+      bind(0, 18 + i,   actionLfoRate,  i);
+      bind(0, 102 + i,  actionLfoDepth, i);
+      bind(0, 106 + i,  actionLfoShape, i);
+      bind(0, 110 + i,  actionLfoSync,  i);
+      bind(0, 85 + i,   actionCvGlide,      i);
+      bind(0, 114 + i,  actionCvGlideMode,  i);
+      bind(0, 75 + i,   actionTrigWidth,    i);
+    }
+    bind(0, 44, actionArm);
+    bind(0, 45, actionOverdub);
+    bind(0, 46, actionClear);
+    bind(0, 47, actionLearn);
+    bind(0, 48, actionProfile, profileNext);
+    bind(0, 49, actionKeep);
+    bind(0, 50, actionAutoLength);
+
+    // page 1: the boppad, on channel 2
+    profile.channelPage[1][kindNote] = 1;
+    profile.ignoredChannels |= 1 << 1;
+    bind(1, 48, actionKeep);    // upper left pad
+    bind(1, 42, actionArm);     // upper right pad
+
+    // page 2: on any other channel
+    profile.omniPage[kindCC] = 2;
+    bind(2, 64, actionKeep);    // treat the sustain pedal as the keep function
+
+    // page 3: layer shaping, on channel 15
+    profile.channelPage[14][kindCC] = 3;
+    for (uint8_t i = 0; i < 9 && i < config.layers; ++i) {
+      bind(3, 20 + i, actionLayerCurve,     i);
+      bind(3, 30 + i, actionLayerTranspose, i);
+      bind(3, 40 + i, actionLayerChannel,   i);
+      bind(3, 50 + i, actionLayerLowNote,   i);
+      bind(3, 60 + i, actionLayerHighNote,  i);
+      bind(3, 70 + i, actionLayerRoute,     i);
+    }
+    for (uint8_t i = 0; i < 16; ++i)
+      bind(3, 80 + i, actionChannelRoute, i);
+    bind(3, 96, actionSystemRoute);
+    for (uint8_t i = 0; i < numberOfCvIns; ++i)
+      bind(3, 100 + i, actionCvInMode, i);
+  }
+
+  void loadProfile(uint8_t n) {
+    if (!persistRestoreBlock(n, &profile, sizeof(profile)))
+      defaultProfile();
+    currentProfile = n;
+    pendingProfile = n;
+  }
+
+
+  ControlBinding lookup(const MidiEvent& ev) {
+    uint8_t type = ev.status >> 4;
+    uint8_t ch = ev.status & 0x0f;
+    Kind kind = kinds[type];
+
+    if (type == 0xf)
+      return { actionIgnore, 0 };     // System Messages
+
+    if (kind != kindNone) {
+      uint8_t p = profile.channelPage[ch][kind];
+      if (p != noPage) {
+        ControlBinding b = profile.pages[p][ev.data1 & 0x7f];
+        if (b.action != actionDefault) return b;
+      }
+    }
+
+    if (profile.ignoredChannels & (1 << ch))
+      return { actionIgnore, 0 };
+
+    if (kind != kindNone) {
+      uint8_t p = profile.omniPage[kind];
+      if (p != noPage) {
+        ControlBinding b = profile.pages[p][ev.data1 & 0x7f];
+        if (b.action != actionDefault) return b;
+      }
+    }
+
+    if (type == 0xc)
+      return { actionIgnore, 0 };     // TODO: echo program changes?
+
+    return { actionRecord, 0 };
+  }
+
+
+  enum LearnState { learnIdle, learnSource, learnTarget };
+  LearnState learnState = learnIdle;
+
+  ControlBinding learnt;
+  uint8_t learntStatus;
+  uint8_t learntNumber;
+
+  uint8_t freePage() {
+    bool used[pageCount] = { };
+    for (auto& c : profile.channelPage)
+      for (auto p : c) if (p != noPage) used[p] = true;
+    for (auto p : profile.omniPage) if (p != noPage) used[p] = true;
+
+    for (uint8_t p = 0; p < pageCount; ++p)
+      if (!used[p]) return p;
+    return noPage;
+  }
+
+  bool learnEvent(const MidiEvent& ev, ControlBinding b) {
+    // returns true if the event was used up by learning
+
+    Kind kind = kinds[ev.status >> 4];
+    if (kind == kindNone || controlValue(ev) == 0)
+      return false;
+      // releases aren't used, so the learn control can be let go
+
+    if (learnState == learnSource) {
+      switch (b.action) {
+        case actionDefault:
+        case actionRecord:
+        case actionIgnore:
+        case actionLearn:
+          return false;
+
+        default:
+          learnt = b;
+          learntStatus = ev.status & 0xef;    // Note On & Off are the same
+          learntNumber = ev.data1;
+          learnState = learnTarget;
+          logMessage("learn: now touch the control to bind");
+          return true;
+      }
+    }
+
+    if ((ev.status & 0xef) == learntStatus && ev.data1 == learntNumber)
+      return true;    // still the same control
+
+    if (persistSavingBlock()) {
+      logMessage("learn: saving, touch it again");
+      return true;
+    }
+      // the profile is being written to flash from where it is, and a
+      // change now could leave a mix of old and new bindings there
+
+    uint8_t ch = ev.status & 0x0f;
+    uint8_t p = profile.channelPage[ch][kind];
+    if (p == noPage) {
+      p = freePage();
+      if (p == noPage) {
+        logMessage("learn: no room in profile");
+        learnState = learnIdle;
+        return true;
+      }
+      for (auto& e : profile.pages[p]) e = { actionDefault, 0 };
+      profile.channelPage[ch][kind] = p;
+    }
+
+    profile.pages[p][ev.data1 & 0x7f] = learnt;
+    dirty = true;
+    learnState = learnIdle;
+    logMessage("learn: bound");
+    return true;
+  }
+}
+
+
+void controlsBegin() {
+  loadProfile(0);
+}
+
+void controlsUpdate(unsigned long) {
+  if (persistSavingBlock())
+    return;
+    // the profile is saved straight from RAM, so it can't be switched
+    // until the save is done, saving the loop doesn't hold it up
+
+  if (dirty) {
+    persistSaveBlock(currentProfile, &profile, sizeof(profile));
+    dirty = false;
+    return;
+  }
+
+  if (pendingProfile != currentProfile) {
+    learnState = learnIdle;
+    loadProfile(pendingProfile);
+    logValue("profile", currentProfile + 1);
+  }
+}
+
+ControlBinding controlLookup(const MidiEvent& ev) {
+  ControlBinding b = lookup(ev);
+  if (learnState != learnIdle && learnEvent(ev, b))
+    return { actionIgnore, 0 };
+  return b;
+}
+
+
+void controlProfile(uint8_t n) {
+  if (n == profileNext)
+    n = pendingProfile + 1;
+  pendingProfile = n % profileCount;
+}
+
+uint8_t controlCurrentProfile() {
+  return currentProfile;
+}
+
+void controlLearn() {
+  if (learnState == learnIdle) {
+    learnState = learnSource;
+    logMessage("learn: touch a control to copy");
+  } else {
+    learnState = learnIdle;
+    logMessage("learn: cancelled");
+  }
+}
+
+bool controlLearning() {
+  return learnState != learnIdle;
+}
@@ -0,0 +1,107 @@
+#ifndef _INCLUDE_CONTROLS_H_
+#define _INCLUDE_CONTROLS_H_
+
+#include <cstdint>
+
+#include "types.h"
+
+
+/**
+***  Control Mapping
+**/
+
+// Every incoming message is looked up in the active profile, which says what
+// to do with it: play it into the loop, ignore it, or run one of the actions
+// below. The lookup is a couple of table reads, whatever the message.
+//
+// Notes and CCs are looked up by channel and number, first in the page for
+// their channel (if it has one), then, unless the channel is one that is
+// otherwise ignored, in the omni page. Anything not found is recorded, except
+// program changes and system messages, which are ignored.
+
+enum ControlAction : uint8_t {
+  // these are saved in profiles, so new ones go on the end
+
+  actionDefault,      // not bound, look further
+  actionRecord,       // play into the loop
+  actionIgnore,
+
+  actionLayerVolume,  // arg is the layer
+  actionLayerMute,    // arg is the layer, mutes while the value is non-zero
+  actionCvOut,        // arg is the output
+
+  // these are triggered when the value is non-zero
+  actionLayerArm,     // arg is the layer
+  actionArm,
+  actionClear,
+  actionKeep,
+  actionOverdub,      // toggles
+  actionSceneRecall,  // arg is the scene
+  actionSceneStore,   // arg is the scene
+  actionProfile,      // arg is the profile, or profileNext
+  actionLearn,        // toggles learning
+
+  // these take the value, arg is the LFO
+  actionLfoRate,
+  actionLfoDepth,
+  actionLfoShape,
+  actionLfoSync,
+
+  // these take the value, arg is the output
+  actionCvGlide,
+  actionCvGlideMode,
+  actionTrigWidth,    // arg is the trigger output
+
+  // these take the value, arg is the layer
+  actionLayerCurve,
+  actionLayerTranspose,
+  actionLayerChannel,
+  actionLayerLowNote,
+  actionLayerHighNote,
+
+  // these take the value, to USB, DIN, or both, see midiout.h
+  actionLayerRoute,   // arg is the layer
+  actionChannelRoute, // arg is the channel
+
+  // triggered when the value is non-zero
+  actionAutoLength,   // toggles, see Loop::autoLength()
+
+  // takes the value, arg is the c.v. input
+  actionCvInMode,     // off, level, pitch, gate, see cvcapture.h
+
+  // takes the value, to USB, DIN, or both, see midiout.h
+  actionSystemRoute,  // for what passes through: clock, SysEx, and the like
+};
+
+struct ControlBinding {
+  uint8_t action;
+  uint8_t arg;
+};
+
+const uint8_t profileCount = 4;
+const uint8_t profileNext = 0xff;
+
+
+void controlsBegin();
+  // loads profile 0, from flash if it was saved there
+void controlsUpdate(unsigned long);
+  // call from loop(), saves learnt bindings, and switches profiles
+
+ControlBinding controlLookup(const MidiEvent&);
+
+inline uint8_t controlValue(const MidiEvent& ev)
+  { return ev.isNoteOff() ? 0 : ev.data2; }
+    // CC value, or note velocity, which is zero for note off
+
+
+void controlProfile(uint8_t);
+  // switch profiles, once the current one has been saved
+uint8_t controlCurrentProfile();
+
+// Learning is by example: touch a control that already does something, then
+// the control that should do it too. The binding is saved in the profile.
+void controlLearn();      // start learning, or cancel it
+bool controlLearning();
+
+
+#endif // _INCLUDE_CONTROLS_H_
@@ -0,0 +1,181 @@
+#include "cvcapture.h"
+
+
+namespace {
+  const uint16_t gateHigh = 4096 * 6 / 10;
+  const uint16_t gateLow = 4096 * 4 / 10;
+
+  const uint8_t lowestPitch = 36;   // C2
+  const uint8_t pitchRange = 61;    // five octaves, and the C at the top
+}
+
+
+void CvCapture::mode(CvInMode m, uint8_t input) {
+  inMode = m;
+  id = input;
+  sent = 0xff;
+    // so a level is sent as soon as there is one
+}
+
+size_t CvCapture::block(const uint16_t* samples, size_t n, size_t stride,
+    int16_t pitchNote, MidiEvent* events) {
+  size_t count = 0;
+
+  if (high && inMode != cvInGate) {
+    events[count++] = { uint8_t(0x80 | cvInChannel), gateNote, 64 };
+    high = false;
+  }
+
+  if (n == 0)
+    return count;
+
+  switch (inMode) {
+    case cvInPitch:
+      level = samples[(n - 1) * stride];
+        // the latest, not the mean, as a sequencer's pitch steps along with
+        // its gate, and a semitone is far wider than the noise
+      break;
+
+    case cvInLevel: {
+      uint32_t sum = 0;
+      for (size_t i = 0; i < n; ++i)
+        sum += samples[i * stride];
+      level = uint16_t(sum / n);
+
+      uint8_t v = uint8_t(level >> 5);
+      if (v == sent)
+        break;
+      if (sent != 0xff) {
+        int32_t lo = int32_t(sent) * 32 - cvInThreshold;
+        int32_t hi = int32_t(sent) * 32 + 32 + cvInThreshold;
+        if (level >= lo && level < hi)
+          break;
+          // not far enough past the step last sent, likely just noise
+      }
+      sent = v;
+      events[count++] =
+        { uint8_t(0xb0 | cvInChannel), uint8_t(cvInCC + id), v };
+      break;
+    }
+
+    case cvInGate:
+      for (size_t i = 0; i < n && count < maxEvents; ++i) {
+        uint16_t s = samples[i * stride];
+        if (!high && s > gateHigh) {
+          high = true;
+          gateNote = pitchNote >= 0
+            ? uint8_t(pitchNote) : uint8_t(cvInNote + id);
+          events[count++] =
+            { uint8_t(0x90 | cvInChannel), gateNote, cvInVelocity };
+        } else if (high && s < gateLow) {
+          high = false;
+          events[count++] = { uint8_t(0x80 | cvInChannel), gateNote, 64 };
+        }
+      }
+      level = samples[(n - 1) * stride];
+      break;
+
+    default:
+      break;
+  }
+
+  return count;
+}
+
+int16_t CvCapture::note() const {
+  if (inMode != cvInPitch)
+    return -1;
+  return int16_t(lowestPitch
+    + ((uint32_t(level) * pitchRange + 2048) >> 12));
+}
+
+
+#if defined(BICYCLE_CVCAPTURE_MAIN)
+
+// Runs a file of samples through, as if from the ADC, and prints the events,
+// each at the sample that ended its block, and how few there were.
+//
+// Each line of the file has a 12 bit sample for each input, in decimal.
+// The modes are a letter for each input: o, l, p, or g, for off, level,
+// pitch, and gate. The first input in pitch mode gives the pitch for gates.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s modes [samples [block]]\n", argv[0]);
+    return 2;
+  }
+
+  const char* modes = argv[1];
+  size_t inputs = std::strlen(modes);
+  FILE* in = argc > 2 && std::strcmp(argv[2], "-")
+    ? std::fopen(argv[2], "r") : stdin;
+  size_t blockSize = argc > 3 ? std::strtoul(argv[3], nullptr, 0) : 8;
+  if (!in || inputs == 0 || blockSize == 0) {
+    std::fprintf(stderr, "usage: %s modes [samples [block]]\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<CvCapture> captures(inputs);
+  for (size_t i = 0; i < inputs; ++i) {
+    const char* letters = "olpg";
+    const char* m = std::strchr(letters, modes[i]);
+    if (!m || !*m) {
+      std::fprintf(stderr, "modes are o, l, p, or g\n");
+      return 2;
+    }
+    captures[i].mode(CvInMode(m - letters), uint8_t(i));
+  }
+
+  std::vector<uint16_t> block;
+  unsigned long samples = 0;
+  unsigned long events = 0;
+
+  auto run = [&]() {
+    // as analog.cpp does: gates last, so they get the pitch of this block
+    size_t n = block.size() / inputs;
+    int16_t pitch = -1;
+    for (int gates = 0; gates < 2; ++gates) {
+      for (size_t i = 0; i < inputs; ++i) {
+        if ((captures[i].mode() == cvInGate) != (gates == 1)) continue;
+
+        MidiEvent evs[CvCapture::maxEvents];
+        size_t k = captures[i].block(&block[i], n, inputs, pitch, evs);
+        for (size_t e = 0; e < k; ++e)
+          std::printf("%lu %02x %02x %02x\n",
+            samples, evs[e].status, evs[e].data1, evs[e].data2);
+        events += k;
+
+        if (pitch < 0) pitch = captures[i].note();
+      }
+    }
+    block.clear();
+  };
+
+  char line[256];
+  while (std::fgets(line, sizeof(line), in)) {
+    char* p = line;
+    for (size_t i = 0; i < inputs; ++i) {
+      char* end;
+      unsigned long v = std::strtoul(p, &end, 10);
+      if (end == p) v = 0;
+      block.push_back(uint16_t(v > 4095 ? 4095 : v));
+      p = end;
+    }
+    samples += 1;
+    if (block.size() == blockSize * inputs)
+      run();
+  }
+  if (!block.empty())
+    run();
+
+  std::fprintf(stderr, "%lu samples of %u inputs, %lu events\n",
+    samples, unsigned(inputs), events);
+  return 0;
+}
+
+#endif
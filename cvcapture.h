@@ -0,0 +1,81 @@
+#ifndef _INCLUDE_CVCAPTURE_H_
+#define _INCLUDE_CVCAPTURE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "types.h"
+
+
+/**
+***  C.V. Capture
+**/
+
+// Turns blocks of 12 bit ADC samples from a c.v. input into the few MIDI
+// events worth recording. The ADC averages in hardware, and DMA fills the
+// blocks, so the CPU only sees each block once, from the main loop:
+//
+//  - level:  the block is decimated to its mean, and a CC is sent only when
+//            that moves past the 7 bit step it was last sent at, by more than
+//            the threshold, so noise on a steady c.v. sends nothing
+//  - pitch:  sends nothing, but tracks the latest sample, as the pitch for
+//            gates
+//  - gate:   each rise past 60% of the range is a NoteOn, and each fall
+//            below 40% its NoteOff: every sample is looked at, so gates
+//            shorter than a block aren't missed
+//
+// Gate notes are the pitch given, or if none, a fixed note for the input.
+
+enum CvInMode : uint8_t {
+  cvInOff,
+  cvInLevel,
+  cvInPitch,
+  cvInGate,
+
+  cvInModeCount
+};
+
+const uint8_t cvInChannel = 0;    // MIDI channel 1
+const uint8_t cvInCC = 16;        // plus the input, for levels
+const uint8_t cvInNote = 60;      // plus the input, for gates without pitch
+const uint8_t cvInVelocity = 100;
+
+const uint16_t cvInThreshold = 8;
+  // in 12 bit codes, past the edge of the 7 bit step last sent
+
+
+class CvCapture {
+public:
+  CvCapture() { }
+
+  void mode(CvInMode m, uint8_t input);
+    // a gate that is high when turned off is ended with its NoteOff
+
+  CvInMode mode() const { return inMode; }
+
+  static const size_t maxEvents = 4;
+
+  size_t block(const uint16_t* samples, size_t n, size_t stride,
+    int16_t pitchNote, MidiEvent* events);
+    // samples are every stride'th value, pitchNote is a MIDI note, or -1
+    // returns the count of events put in events, at most maxEvents
+
+  int16_t note() const;
+    // the note for the last level seen: five octaves up from C2 over the
+    // input's range, or -1 unless in pitch mode
+
+private:
+  CvInMode inMode = cvInOff;
+  uint8_t id = 0;
+
+  uint16_t level = 0;       // 12 bit mean of the last block
+  uint8_t sent = 0xff;      // 7 bit CC value last sent, or 0xff for none
+  bool high = false;        // the gate is up
+  uint8_t gateNote = 0;     // the note it started
+};
+
+
+// Build with:  g++ -O2 -DBICYCLE_CVCAPTURE_MAIN cvcapture.cpp
+// to run sample files through, see cvcapture.cpp
+
+#endif // _INCLUDE_CVCAPTURE_H_
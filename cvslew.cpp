@@ -0,0 +1,130 @@
+#include "cvslew.h"
+
+
+#if defined(BICYCLE_CVSLEW_MAIN)
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+
+namespace {
+  class Random {
+  public:
+    Random(uint32_t seed) : s(seed ? seed : 1) { }
+    uint32_t next() {
+      s ^= s << 13;
+      s ^= s >> 17;
+      s ^= s << 5;
+      return s;
+    }
+    uint32_t below(uint32_t n) { return next() % n; }
+  private:
+    uint32_t s;
+  };
+
+  const char* glideNames[glideCount] = { "step", "linear", "exponential" };
+
+  const size_t blockSize = 8;   // as in analog.cpp
+
+  // The glides, worked out in floating point: a straight line from wherever
+  // the level was when the target changed, or an exponential with the same
+  // time constant as the slew, a power of two samples.
+
+  class FloatSlew {
+  public:
+    void target(double g, CvGlide m, uint16_t n) {
+      goal = g;
+      glide = m;
+      from = level;
+      samples = n;
+      done = 0;
+      uint16_t tau = n / 3;
+      int shift = 0;
+      while (tau >>= 1) shift += 1;
+      rate = 1.0 / double(1 << shift);
+    }
+
+    double next() {
+      switch (glide) {
+        case glideLinear:
+          done = std::min<uint32_t>(done + 1, samples);
+          level = samples ? from + (goal - from) * done / samples : goal;
+          break;
+        case glideExponential:
+          level += (goal - level) * rate;
+          break;
+        default:
+          level = goal;
+          break;
+      }
+      return level;
+    }
+
+  private:
+    double level = 0;
+    double goal = 0;
+    double from = 0;
+    double rate = 1;
+    CvGlide glide = glideStep;
+    uint32_t samples = 0;
+    uint32_t done = 0;
+  };
+
+  double run(CvGlide m, uint16_t glideSamples, uint32_t blocks, Random& rand) {
+    // Targets change between blocks, as they do when set from the main loop,
+    // half the time before a glide is over, and half the time well after.
+    //
+    // The slew's output is its level rounded down, so the float glide should
+    // be within the LSB above it. Returns the most the float glide was
+    // outside that, in LSBs of Q15.
+    CvSlew slew;
+    FloatSlew ref;
+    slew.mode(m);
+    slew.time(glideSamples);
+
+    double worst = 0;
+    uint32_t hold = 0;
+    for (uint32_t b = 0; b < blocks; ++b) {
+      if (hold == 0) {
+        int16_t g = int16_t(int32_t(rand.below(65536)) - 32768);
+        slew.target(g);
+        ref.target(g, m, glideSamples);
+        hold = 1 + (rand.below(2) ? rand.below(4)
+          : rand.below(2 * glideSamples / blockSize + 4));
+      }
+      hold -= 1;
+
+      for (size_t n = 0; n < blockSize; ++n) {
+        int16_t v = slew.next();
+        double r = ref.next();
+        worst = std::max(worst, std::max(v - r, r - (v + 1)));
+      }
+    }
+    return worst;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t blocks = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 200000;
+  uint32_t seed = argc > 2 ? std::strtoul(argv[2], nullptr, 0) : 1;
+
+  // glides from none to the longest, 32s at the 2kHz output sample rate
+  const uint16_t times[] = { 0, 1, 7, 8, 100, 1000, 8000, 65535 };
+
+  Random rand(seed);
+  bool ok = true;
+  for (int m = 0; m < glideCount; ++m) {
+    double worst = 0;
+    for (uint16_t t : times)
+      worst = std::max(worst, run(CvGlide(m), t, blocks, rand));
+    bool good = worst <= 1.0;
+    ok = ok && good;
+    std::printf("%-12s most off by %.2f LSB%s\n",
+      glideNames[m], worst, good ? "" : "  FAILED");
+  }
+  return ok ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef _INCLUDE_CVSLEW_H_
+#define _INCLUDE_CVSLEW_H_
+
+#include <cstdint>
+
+
+/**
+***  C.V. Slew
+**/
+
+// Moves an output towards its target a sample at a time: at once, in a
+// straight line over the glide time, or exponentially with a time constant
+// of about a third of it. Levels are Q15, as for the LFOs, and next() is
+// integer only, for the output block generator.
+//
+// Targets and settings are single words, set from the main loop. The glide
+// is worked out again, in next(), whenever the target changes.
+
+enum CvGlide : uint8_t {
+  glideStep,
+  glideLinear,
+  glideExponential,
+
+  glideCount
+};
+
+
+class CvSlew {
+public:
+  void target(int16_t v)        { goal = v; }
+  void time(uint16_t samples)   { glideSamples = samples; }
+  void mode(CvGlide m)          { glide = m; }
+
+  int16_t next() {
+    int16_t g = goal;
+    if (g != aimedAt)
+      aim(g);
+
+    int32_t end = int32_t(aimedAt) << fracBits;
+    switch (glide) {
+      case glideLinear:
+        if (remaining) {
+          level += step;
+          carry += spill;
+          if (carry >= span)        { level += 1; carry -= span; }
+          else if (carry <= -span)  { level -= 1; carry += span; }
+          remaining -= 1;
+        }
+        if (!remaining) level = end;
+        break;
+
+      case glideExponential: {
+        int32_t d = (end - level) >> shift;
+        if (d) level += d;
+        else   level = end;
+        break;
+      }
+
+      default:
+        level = end;
+        break;
+    }
+
+    return int16_t(level >> fracBits);
+  }
+
+private:
+  static const int fracBits = 14;
+    // so the distance between any two levels still fits in 32 bits
+
+  volatile int16_t goal = 0;
+  volatile uint16_t glideSamples = 0;
+  volatile CvGlide glide = glideStep;
+
+  int16_t aimedAt = 0;
+  int32_t level = 0;
+  int32_t step = 0;
+  int32_t spill = 0;        // what step leaves over, per span samples
+  int32_t carry = 0;        // so the line doesn't drift, however long
+  int32_t span = 0;
+  uint16_t remaining = 0;
+  uint8_t shift = 0;
+
+  void aim(int16_t g) {
+    aimedAt = g;
+    uint16_t n = glideSamples;
+
+    int32_t d = (int32_t(g) << fracBits) - level;
+    remaining = n;
+    span = n;
+    step = n ? d / n : 0;
+    spill = n ? d % n : 0;
+    carry = 0;
+
+    uint16_t tau = n / 3;
+    shift = 0;
+    while (tau >>= 1)
+      shift += 1;
+  }
+};
+
+
+// Build with:  g++ -O2 -DBICYCLE_CVSLEW_MAIN cvslew.cpp
+// to check the glides, a block at a time, against floating point ones
+
+#endif // _INCLUDE_CVSLEW_H_
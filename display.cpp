@@ -7,33 +7,32 @@ namespace {
 
   Loop::Status currentStatus;
 
-  class LoopField : public Field {
+  class LoopEndField : public Field {
   public:
-    LoopField(int16_t x, int16_t y, uint16_t w, uint16_t h)
-      : Field(x, y, w, h)
+    LoopEndField(int16_t x, int16_t y, uint16_t w, uint16_t h, bool right)
+      : Field(x, y, w, h), right(right)
       {}
 
   protected:
     virtual bool isOutOfDate() {
-      return drawnLooping != currentStatus.looping
-          || drawnMarkerX != markerX();
+      return right && drawnLooping != currentStatus.looping;
+        // the end of the loop shows only once it is closed
     }
 
     virtual void redraw() {
       drawnLooping = currentStatus.looping;
-      drawnMarkerX = markerX();
 
       uint16_t c = foreColor();
       uint16_t ymid = y + h/2;
 
       // FIXME: Make these bitmaps
-      display.drawFastVLine(x + 0, y, h, c);
-      display.drawFastVLine(x + 1, y, h, c);
-      display.drawFastVLine(x + 3, y, h, c);
-      display.fillRect(x + 5, ymid - 3, 2, 2, c);
-      display.fillRect(x + 5, ymid + 2, 2, 2, c);
-
-      if (drawnLooping) {
+      if (!right) {
+        display.drawFastVLine(x + 0, y, h, c);
+        display.drawFastVLine(x + 1, y, h, c);
+        display.drawFastVLine(x + 3, y, h, c);
+        display.fillRect(x + 5, ymid - 3, 2, 2, c);
+        display.fillRect(x + 5, ymid + 2, 2, 2, c);
+      } else if (drawnLooping) {
         display.drawFastVLine(x + w - 1, y, h, c);
         display.drawFastVLine(x + w - 2, y, h, c);
         display.drawFastVLine(x + w - 4, y, h, c);
@@ -42,20 +41,88 @@ namespace {
       }
 
       display.drawFastHLine(x, ymid, w, c);
+    }
+
+  private:
+    const bool right;
+    bool drawnLooping;
+  };
 
-      display.drawFastVLine(x + 8 + drawnMarkerX, ymid - 3, 7, c);
+
+  // Between the ends, a column for each column of Loop::Density, with a bar as
+  // tall as the log of the number of notes there, in layers not muted, and the
+  // play position as a line. Drawing it all 20 times a second is too slow, so
+  // it isn't a Field: only the columns that have changed are redrawn.
+  class LoopStrip {
+  public:
+    LoopStrip(int16_t x, int16_t y, uint16_t h)
+      : x(x), y(y), h(h)
+      {}
+
+    bool render(bool force) {
+      const Loop::Density* d = currentStatus.density;
+      bool all = force
+        || drawnLooping != currentStatus.looping
+        || drawnMutes != currentStatus.layerMutes;
+          // mutes change which notes are counted, in every column
+
+      uint16_t priorMarkerX = drawnMarkerX;
+      drawnLooping = currentStatus.looping;
+      drawnMutes = currentStatus.layerMutes;
+      drawnMarkerX = markerX();
+      bool moved = drawnMarkerX != priorMarkerX;
+
+      bool drew = false;
+      for (uint8_t col = 0; col < cols; ++col) {
+        bool changed = d && drawnChanges[col] != d->changes[col];
+        if (all || changed
+            || (moved && (col == drawnMarkerX || col == priorMarkerX))) {
+          if (d) drawnChanges[col] = d->changes[col];
+          drawColumn(col, d);
+          drew = true;
+        }
+      }
+      return drew;
     }
 
   private:
-    bool      drawnLooping;
-    uint16_t  drawnMarkerX;
+    static const uint8_t cols = Loop::densityColumns;
+
+    const int16_t x, y;
+    const uint16_t h;
+
+    std::array<uint8_t, cols> drawnChanges;
+    std::array<bool, Loop::layerLimit> drawnMutes;
+    bool drawnLooping;
+    uint16_t drawnMarkerX;
 
     uint16_t markerX() {
-      uint32_t l = w - 16 - 1;
+      uint32_t l = cols - 1;
       if (currentStatus.length == 0) return 0;
 
       return currentStatus.position * l / currentStatus.length;
     }
+
+    void drawColumn(uint8_t col, const Loop::Density* d) {
+      int16_t cx = x + col;
+      int16_t ymid = y + h/2;
+
+      display.drawFastVLine(cx, y, h, BLACK);
+      if (col == drawnMarkerX) {
+        display.drawFastVLine(cx, y, h, WHITE);
+        return;
+      }
+
+      uint32_t n = 0;
+      if (d)
+        for (uint8_t i = 0; i < Loop::layerLimit; ++i)
+          if (!drawnMutes[i]) n += d->notes[i][col];
+
+      int16_t r = 0;
+      for (; n && r < h/2 - 1; n >>= 1) r += 1;
+        // 1 note is r 1, 2 ~ 3 are r 2, 4 ~ 7 are r 3, ...
+      display.drawFastVLine(cx, ymid - r, 2 * r + 1, WHITE);
+    }
   };
 
 
@@ -125,26 +192,24 @@ namespace {
       auto p = x;
 
       for (uint8_t i = 0; i < drawnLayerCount; ++i) {
-        if (i >= drawnLayerMutes.size()) {
-          display.writePixel(p    , y + 3, c);
-          display.writePixel(p + 2, y + 3, c);
-          display.writePixel(p + 4, y + 3, c);
-          break;
-        }
         if (i == drawnActiveLayer && drawnLayerArmed)
-                                      display.drawRect(p, y, 4, 4, c);
-        else if (drawnLayerMutes[i])  display.drawFastHLine(p, y + 3, 4, c);
-        else                          display.fillRect(p, y, 4, 4, c);
+                                      display.drawRect(p, y, box, box, c);
+        else if (drawnLayerMutes[i])  display.drawFastHLine(p, y + box - 1, box, c);
+        else                          display.fillRect(p, y, box, box, c);
 
-        p += 5 + (i % 3 == 2 ? 2 : 0);
+        p += box + 1 + (i % group == group - 1 ? 2 : 0);
       }
     }
 
   private:
+    // smaller boxes, in groups of four, when there are more than nine
+    static const int box = Loop::layerLimit > 9 ? 3 : 4;
+    static const int group = Loop::layerLimit > 9 ? 4 : 3;
+
     uint8_t drawnLayerCount;
     uint8_t drawnActiveLayer;
     bool drawnLayerArmed;
-    std::array<bool, 9> drawnLayerMutes;
+    std::array<bool, Loop::layerLimit> drawnLayerMutes;
   };
 
 
@@ -161,10 +226,77 @@ namespace {
   };
 
 
-  auto loopField = LoopField(0, 0, 128, 13);
+  class OverdubField : public TextField<bool> {
+  public:
+    OverdubField(int16_t x, int16_t y, uint16_t w, uint16_t h)
+      : TextField<bool>(x, y, w, h) { }
+  protected:
+    void drawValue(const bool& overdubbing) const {
+      if (overdubbing)
+        display.print("+");
+    }
+    bool getValue() const { return currentStatus.overdubbing; }
+  };
+
+
+  class CellsField : public Field {
+  public:
+    CellsField(int16_t x, int16_t y, uint16_t w, uint16_t h)
+      : Field(x, y, w, h) { }
+  protected:
+    bool isOutOfDate() {
+      return drawnUsedX != usedX() || drawnMostX != mostX();
+    }
+    void redraw() {
+      drawnUsedX = usedX();
+      drawnMostX = mostX();
+
+      auto c = foreColor();
+      display.drawRect(x, y + 1, w, h - 2, c);
+      display.fillRect(x, y + 1, drawnUsedX, h - 2, c);
+      display.drawFastVLine(x + drawnMostX, y, h, c);
+        // the high water mark sticks out above and below
+    }
+
+  private:
+    uint16_t drawnUsedX;
+    uint16_t drawnMostX;
+
+    uint16_t scaled(uint16_t cells) {
+      if (currentStatus.cellsTotal == 0) return 0;
+      return uint32_t(cells) * (w - 1) / currentStatus.cellsTotal;
+    }
+    uint16_t usedX()
+      { return scaled(currentStatus.cellsTotal - currentStatus.cellsFree); }
+    uint16_t mostX()
+      { return scaled(currentStatus.cellsMostUsed); }
+  };
+
+
+  class RecordTimeField : public TextField<uint16_t> {
+  public:
+    RecordTimeField(int16_t x, int16_t y, uint16_t w, uint16_t h)
+      : TextField<uint16_t>(x, y, w, h) { }
+  protected:
+    void drawValue(const uint16_t& t) const {
+      if (t == 0xffff)      return;   // not recording anything
+      else if (t >= 6000)   display.print(" 99m+");
+      else if (t >= 100)    display.printf("%3dm", t / 60);
+      else                  display.printf("%3ds", t);
+    }
+    uint16_t getValue() const { return currentStatus.recordTimeLeft; }
+  };
+
+
+  auto loopStartField = LoopEndField(0, 0, 8, 13, false);
+  auto loopEndField = LoopEndField(120, 0, 8, 13, true);
+  auto loopStrip = LoopStrip(8, 0, 13);
   auto lengthField = LengthField(92, 15, 28, 8);
   auto layerField = LayerField(20, 15, 80, 5);
   auto armedField = ArmedField(0, 15, 10, 20);
+  auto overdubField = OverdubField(10, 15, 8, 8);
+  auto cellsField = CellsField(20, 24, 64, 6);
+  auto recordTimeField = RecordTimeField(92, 24, 30, 8);
 
   //auto mainPage = Layout({&loopField}, 0);
 
@@ -197,10 +329,15 @@ namespace {
       smallText();
     }
 
-    drew |= loopField.render(force);
+    drew |= loopStartField.render(force);
+    drew |= loopEndField.render(force);
+    drew |= loopStrip.render(force);
     drew |= lengthField.render(force);
     drew |= layerField.render(force);
     drew |= armedField.render(force);
+    drew |= overdubField.render(force);
+    drew |= cellsField.render(force);
+    drew |= recordTimeField.render(force);
 
     if (drew)
       display.display();
@@ -0,0 +1,275 @@
+#include "eventlog.h"
+
+#include <cstdio>
+#include <cstring>
+
+
+#if defined(ARDUINO)
+
+#include <Arduino.h>
+
+
+namespace {
+
+  struct Record {
+    uint32_t    time;
+    LogKind     kind;
+    uint8_t     a, b, c;
+    const char* text;
+  };
+
+  const uint32_t capacity = 64;   // must be a power of two
+  Record ring[capacity];
+  volatile uint32_t head = 0;     // count of records put in
+  volatile uint32_t tail = 0;     // count of records taken out
+  volatile uint16_t dropped = 0;
+
+  bool binary = false;
+
+  void push(LogKind kind, uint8_t a, uint8_t b, uint8_t c,
+      const char* text = nullptr) {
+    if (!binary && kind != logText && kind != logTextValue)
+      return;
+
+    uint32_t time = millis();
+
+    // may be called from interrupts
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (head - tail >= capacity) {
+      if (dropped < 0xffff) dropped += 1;
+    } else {
+      ring[head % capacity] = { time, kind, a, b, c, text };
+      head += 1;
+    }
+    __set_PRIMASK(primask);
+  }
+
+
+  // What is being sent: a record is sent in two parts, so the text of
+  // messages can be sent from where it is.
+
+  struct Part {
+    const uint8_t*  data;
+    size_t          len;
+  };
+  Part parts[2];
+  int partCount = 0;
+  int part = 0;
+  size_t partPos = 0;
+
+  uint8_t header[logRecordSize];
+  char suffix[16];
+
+  void stageText(const char* text, const char* fmt, unsigned value) {
+    parts[0] = { reinterpret_cast<const uint8_t*>(text), strlen(text) };
+    int n = snprintf(suffix, sizeof(suffix), fmt, value);
+    parts[1] = { reinterpret_cast<const uint8_t*>(suffix), size_t(n) };
+    partCount = 2;
+  }
+
+  void stageRecord(const Record& r) {
+    size_t textLen = r.text ? strlen(r.text) : 0;
+    if (textLen > 255) textLen = 255;
+
+    header[0] = logSync;
+    header[1] = r.kind;
+    header[2] = r.text ? uint8_t(textLen) : r.a;
+    header[3] = r.b;
+    header[4] = r.c;
+    header[5] = uint8_t(r.time);
+    header[6] = uint8_t(r.time >> 8);
+    header[7] = uint8_t(r.time >> 16);
+
+    parts[0] = { header, sizeof(header) };
+    parts[1] = { reinterpret_cast<const uint8_t*>(r.text), textLen };
+    partCount = r.text ? 2 : 1;
+  }
+
+  bool stageNext() {
+    part = 0;
+    partPos = 0;
+    partCount = 0;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint16_t lost = dropped;
+    dropped = 0;
+    __set_PRIMASK(primask);
+
+    if (lost) {
+      if (binary)
+        stageRecord({ uint32_t(millis()), logDropped, 0,
+          uint8_t(lost), uint8_t(lost >> 8), nullptr });
+      else
+        stageText("log dropped", " %u\r\n", lost);
+      return true;
+    }
+
+    while (tail != head) {
+      Record r = ring[tail % capacity];
+      tail += 1;
+
+      if (binary) {
+        stageRecord(r);
+        return true;
+      }
+      switch (r.kind) {
+        case logText:
+          stageText(r.text, "\r\n", 0);
+          return true;
+        case logTextValue:
+          stageText(r.text, " %u\r\n", r.b | (r.c << 8));
+          return true;
+        default:
+          break;    // left from binary mode
+      }
+    }
+    return false;
+  }
+}
+
+
+void logMessage(const char* text) {
+  push(logText, 0, 0, 0, text);
+}
+
+void logValue(const char* text, uint16_t value) {
+  push(logTextValue, 0, uint8_t(value), uint8_t(value >> 8), text);
+}
+
+void logMidi(LogKind kind, const MidiEvent& ev) {
+  push(kind, ev.status, ev.data1, ev.data2);
+}
+
+void logEvent(LogKind kind, uint8_t a, uint8_t b, uint8_t c) {
+  push(kind, a, b, c);
+}
+
+void logBinary(bool b) {
+  binary = b;
+}
+
+bool logBinary() {
+  return binary;
+}
+
+void logUpdate() {
+  if (!Serial) return;
+    // nothing is listening, it'll be dropped in time
+
+  int room = Serial.availableForWrite();
+  while (room > 0) {
+    if (part >= partCount && (Serial.available() > 0 || !stageNext()))
+      return;
+      // a command is waiting, see transfer.h, and what it sends mustn't
+      // land in the middle of a record
+
+    const Part& p = parts[part];
+    size_t n = p.len - partPos;
+    if (n > size_t(room)) n = room;
+    if (n) Serial.write(p.data + partPos, n);
+    room -= n;
+    partPos += n;
+
+    if (partPos >= p.len) {
+      part += 1;
+      partPos = 0;
+    }
+  }
+}
+
+bool logIdle() {
+  return part >= partCount;
+}
+
+#endif
+
+
+
+#if !defined(ARDUINO)
+
+bool logDecode(FILE* in, FILE* out) {
+  static const char* stateNames[] = {
+    "looping", "length", "active layer", "scene"
+  };
+
+  bool clean = true;
+  uint8_t h[logRecordSize];
+  int ch;
+
+  while ((ch = std::fgetc(in)) != EOF) {
+    if (ch != logSync) {
+      clean = false;    // lost our place, look for the next record
+      continue;
+    }
+    h[0] = ch;
+    if (std::fread(h + 1, 1, sizeof(h) - 1, in) != sizeof(h) - 1)
+      break;
+    if (h[1] >= logKindCount) {
+      clean = false;
+      continue;
+    }
+
+    uint32_t time = h[5] | (h[6] << 8) | (h[7] << 16);
+    unsigned value = h[3] | (h[4] << 8);
+    std::fprintf(out, "%8u ", time);
+
+    switch (h[1]) {
+      case logText:
+      case logTextValue: {
+        char text[256];
+        size_t n = std::fread(text, 1, h[2], in);
+        text[n] = '\0';
+        if (h[1] == logTextValue)
+          std::fprintf(out, "%s %u\n", text, value);
+        else
+          std::fprintf(out, "%s\n", text);
+        break;
+      }
+
+      case logDropped:
+        std::fprintf(out, "dropped %u\n", value);
+        break;
+
+      case logMidiIn:
+      case logMidiOut:
+        std::fprintf(out, "%s %02x %02x %02x\n",
+          h[1] == logMidiIn ? "in " : "out", h[2], h[3], h[4]);
+        break;
+
+      case logAction:
+        std::fprintf(out, "action %u %u %u\n", h[2], h[3], h[4]);
+        break;
+
+      case logState:
+        if (h[2] < sizeof(stateNames) / sizeof(stateNames[0]))
+          std::fprintf(out, "%s %u\n", stateNames[h[2]], value);
+        else
+          std::fprintf(out, "state %u %u\n", h[2], value);
+        break;
+    }
+  }
+
+  return clean;
+}
+
+
+#if defined(BICYCLE_LOGDECODE_MAIN)
+
+int main(int argc, char* argv[]) {
+  FILE* in = argc > 1 ? std::fopen(argv[1], "rb") : stdin;
+  FILE* out = argc > 2 ? std::fopen(argv[2], "w") : stdout;
+  if (!in || !out) {
+    std::fprintf(stderr, "usage: %s [log [output]]\n", argv[0]);
+    return 2;
+  }
+
+  bool ok = logDecode(in, out);
+  std::fclose(out);
+  return ok ? 0 : 1;
+}
+
+#endif
+
+#endif
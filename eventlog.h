@@ -0,0 +1,78 @@
+#ifndef _INCLUDE_EVENTLOG_H_
+#define _INCLUDE_EVENTLOG_H_
+
+#include <cstdint>
+
+#include "types.h"
+
+
+/**
+***  Event Log
+**/
+
+// Records go into a ring buffer, and are sent out over Serial from
+// logUpdate(), only as fast as there is room to write without waiting. When
+// the ring is full, records are dropped, and counted, never waited for.
+//
+// There are two modes:
+//  - text, the default: only messages are logged, and are sent as lines
+//  - binary: everything is logged, and sent as records, see below
+// The 'L' command (see transfer.h) switches between them.
+//
+// Binary records are eight bytes:
+//    0xA5, kind, a, b, c, time (milliseconds, 24 bits, little endian)
+// logText and logTextValue records are followed by a bytes of text.
+
+enum LogKind : uint8_t {
+  logText,        // a: text length
+  logTextValue,   // a: text length, b & c: a 16 bit value, little endian
+  logDropped,     // b & c: how many records were dropped
+  logMidiIn,      // a, b, c: the message
+  logMidiOut,     // a, b, c: the message
+  logAction,      // a: ControlAction, b: arg, c: value
+  logState,       // a: LogStateField, b & c: the new value
+
+  logKindCount
+};
+
+enum LogStateField : uint8_t {
+  stateLooping,
+  stateLength,      // in 10ms
+  stateActiveLayer,
+  stateScene,
+};
+
+const uint8_t logSync = 0xA5;
+const uint8_t logRecordSize = 8;
+
+
+void logMessage(const char* text);
+  // text must be a string constant, it is sent later
+void logValue(const char* text, uint16_t value);
+
+void logMidi(LogKind, const MidiEvent&);
+void logEvent(LogKind, uint8_t a, uint8_t b, uint8_t c);
+
+void logBinary(bool);
+bool logBinary();
+
+void logUpdate();
+  // call from loop(), sends what can be sent without waiting
+  // while a command is waiting on Serial, no new record is started
+bool logIdle();
+  // no record is part way out, so something else can be sent
+
+
+#if !defined(ARDUINO)
+#include <cstdio>
+
+// host side decoding of a binary log into lines of text
+//
+// Build with:  g++ -O2 -DBICYCLE_LOGDECODE_MAIN eventlog.cpp
+
+bool logDecode(FILE* in, FILE* out);
+  // returns false if the stream had to be resynchronized
+#endif
+
+
+#endif // _INCLUDE_EVENTLOG_H_
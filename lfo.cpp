@@ -0,0 +1,153 @@
+#include "lfo.h"
+
+#include <cmath>
+
+
+std::array<int16_t, (1 << Lfo::tableBits) + 1> Lfo::sineTable;
+uint32_t Lfo::randomState = 0x12345678;
+
+void Lfo::begin() {
+  const float twoPi = 6.2831853f;
+  const int n = 1 << tableBits;
+  for (int i = 0; i <= n; ++i)
+    sineTable[i] = int16_t(lroundf(32767.0f * sinf(twoPi * i / n)));
+}
+
+void Lfo::frequency(float hz, float sampleRate) {
+  increment = uint32_t(hz / sampleRate * 4294967296.0f);
+}
+
+void Lfo::cyclesPer(uint32_t samples, uint8_t cycles) {
+  if (samples == 0) return;
+  increment = uint32_t((uint64_t(cycles) << 32) / samples);
+}
+
+void Lfo::newCycle() {
+  // xorshift, good enough for wobbling a voltage
+  uint32_t r = randomState;
+  r ^= r << 13;
+  r ^= r >> 17;
+  r ^= r << 5;
+  randomState = r;
+
+  randomFrom = randomTo;
+  randomTo = int16_t(r >> 16);
+}
+
+
+#if defined(BICYCLE_LFO_MAIN)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+
+namespace {
+  // the float waveforms the LFOs replaced, phase in [0.0..1.0)
+
+  const double twoPi = 6.283185307179586;
+
+  double floatWave(LfoShape s, double p, double from, double to) {
+    switch (s) {
+      case lfoSine:     return std::sin(p * twoPi);
+      case lfoTriangle: return 4 * (p < 0.5 ? p : (1 - p)) - 1;
+      case lfoSaw:      return 2 * p - 1;
+      case lfoSquare:   return p < 0.5 ? -1 : 1;
+      case lfoRandom:   return from + (to - from) * p;
+      default:          return 0;
+    }
+  }
+
+  const char* shapeNames[lfoShapeCount] =
+    { "sine", "triangle", "saw", "square", "random" };
+
+  uint32_t randomState = 0x12345678;
+    // follows Lfo::randomState, which every LFO moves on, whatever its
+    // shape, as it wraps: so all the comparing is done before the timing
+
+  void newCycle(double& from, double& to) {
+    uint32_t r = randomState;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    randomState = r;
+    from = to;
+    to = int16_t(r >> 16) / 32768.0;
+  }
+
+  double compare(LfoShape s, float hz, float sampleRate, uint32_t ticks) {
+    // largest difference, in LSBs of Q15, from the float wave at full depth
+    Lfo lfo;
+    lfo.shape(s);
+    lfo.depth(32767);
+    lfo.frequency(hz, sampleRate);
+
+    double from = 0, to = 0;
+    uint32_t last = 0;
+
+    double worst = 0;
+    for (uint32_t i = 0; i < ticks; ++i) {
+      int16_t q = lfo.tick();
+      uint32_t p = lfo.at();
+      if (p < last) newCycle(from, to);
+      last = p;
+
+      double ref = floatWave(s, p / 4294967296.0, from, to) * 32768.0;
+      worst = std::max(worst, std::fabs(ref - q));
+    }
+    return worst;
+  }
+
+  double nsPerTick(LfoShape s, uint32_t ticks) {
+    Lfo lfo;
+    lfo.shape(s);
+    lfo.depth(32767);
+    lfo.frequency(3.0f, 1000.0f);
+
+    volatile int32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    int32_t sum = 0;
+    for (uint32_t i = 0; i < ticks; ++i)
+      sum += lfo.tick();
+    sink = sum;
+    (void)sink;
+    std::chrono::duration<double, std::nano> took =
+      std::chrono::steady_clock::now() - start;
+    return took.count() / ticks;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t ticks = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 1000000;
+
+  Lfo::begin();
+
+  // Each shape is compared over a range of rates, at the waveform sample
+  // rate: the LFO is free to differ from the float wave by its rounding, and
+  // that of the depth, and the sine by its table, but no more. Random had no
+  // float version, so is checked against a float slide between the same
+  // random levels, which the LFO steps through 1/32768 of a cycle at a time.
+  const float hzs[] = { 0.05f, 1.0f, 7.3f, 55.0f };
+  const float sampleRate = 2000.0f;
+  const double limits[lfoShapeCount] = { 8, 2, 2, 2, 4 };
+
+  double worst[lfoShapeCount] = { };
+  for (int s = 0; s < lfoShapeCount; ++s)
+    for (float hz : hzs)
+      worst[s] = std::max(worst[s],
+        compare(LfoShape(s), hz, sampleRate, ticks));
+
+  bool ok = true;
+  for (int s = 0; s < lfoShapeCount; ++s) {
+    bool good = worst[s] <= limits[s];
+    ok = ok && good;
+    std::printf("%-8s  most off by %5.2f LSB (%.1e), %5.2f ns per tick%s\n",
+      shapeNames[s], worst[s], worst[s] / 32768,
+      nsPerTick(LfoShape(s), ticks * 10), good ? "" : "  FAILED");
+  }
+  std::printf("on this host, %.0f million ticks per second, for the sine\n",
+    1000.0 / nsPerTick(lfoSine, ticks * 10));
+  return ok ? 0 : 1;
+}
+
+#endif
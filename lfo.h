@@ -0,0 +1,106 @@
+#ifndef _INCLUDE_LFO_H_
+#define _INCLUDE_LFO_H_
+
+#include <array>
+#include <cstdint>
+
+
+/**
+***  Low Frequency Oscillators
+**/
+
+// Phase is a 32 bit accumulator, so it wraps by itself, and outputs are Q15:
+// [-32768..32767] stands for [-1.0..1.0). tick() is integer only, and cheap
+// enough to run for every output from the sample interrupt. Everything else
+// is for the main loop, and may use floats.
+//
+// The parameters are each a single aligned word or byte, so they can be set
+// while the interrupt is running.
+
+enum LfoShape : uint8_t {
+  lfoSine,
+  lfoTriangle,
+  lfoSaw,
+  lfoSquare,
+  lfoRandom,      // a new random level each cycle, slid to from the last
+
+  lfoShapeCount
+};
+
+
+class Lfo {
+public:
+  static void begin();
+    // builds the sine table, before any Lfo ticks
+
+  void frequency(float hz, float sampleRate);
+  void cyclesPer(uint32_t samples, uint8_t cycles);
+    // for sync: this many cycles over this many samples
+
+  void shape(LfoShape s)    { waveShape = s; }
+  void depth(int16_t d)     { level = d; }      // Q15, 0 is off
+  void reset()              { phase = 0; }
+
+  bool on() const           { return level != 0; }
+  uint32_t at() const       { return phase; }
+
+  int16_t tick() {
+    uint32_t p = phase + increment;
+    phase = p;
+    if (p < increment) newCycle();
+    return int16_t((int32_t(wave(p)) * level) >> 15);
+  }
+
+private:
+  volatile uint32_t phase = 0;
+  volatile uint32_t increment = 0;
+  volatile int16_t level = 0;
+  volatile LfoShape waveShape = lfoSine;
+
+  int16_t randomFrom = 0;
+  int16_t randomTo = 0;
+
+  static const int tableBits = 8;
+  static std::array<int16_t, (1 << tableBits) + 1> sineTable;
+    // one extra, so interpolation never has to wrap
+  static uint32_t randomState;
+
+  void newCycle();
+
+  int16_t wave(uint32_t p) const {
+    switch (waveShape) {
+      case lfoSine: {
+        uint32_t i = p >> (32 - tableBits);
+        int32_t f = int32_t((p >> (16 - tableBits)) & 0xffff);
+        int32_t a = sineTable[i];
+        int32_t b = sineTable[i + 1];
+        return int16_t(a + (((b - a) * f) >> 16));
+      }
+
+      case lfoTriangle: {
+        uint32_t t = p < 0x80000000u ? p : ~p;
+        return int16_t(int32_t(t >> 15) - 32768);
+      }
+
+      case lfoSaw:
+        return int16_t(int32_t(p >> 16) - 32768);
+
+      case lfoSquare:
+        return p < 0x80000000u ? -32768 : 32767;
+
+      case lfoRandom: {
+        int32_t d = int32_t(randomTo) - int32_t(randomFrom);
+        return int16_t(randomFrom + ((d * int32_t(p >> 17)) >> 15));
+      }
+
+      default:
+        return 0;
+    }
+  }
+};
+
+
+// Build with:  g++ -O2 -DBICYCLE_LFO_MAIN lfo.cpp
+// to compare the waves with the float ones they replaced, and time tick()
+
+#endif // _INCLUDE_LFO_H_
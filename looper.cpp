@@ -4,6 +4,7 @@
 #include <cassert>
 #include <cstring>
 
+#include "beatfit.h"
 #include "cell.h"
 
 
@@ -14,67 +15,374 @@ namespace {
   }
 
   inline uint8_t scaleVelocity(uint8_t vel, uint8_t vol) {
-    return static_cast<uint8_t>(clamp(
+    return static_cast<uint8_t>(clamp<uint32_t>(
       static_cast<uint32_t>(vel) * static_cast<uint32_t>(vol) / 100,
-      0ul, 127ul));
+      0, 127));
   }
 }
 
 class Loop::Util {
 public:
-  static void startAwaitingOff(Loop& loop, Cell* cell) {
+  static const AbsTime noOff = 0xffffffff;
+
+  static uint8_t channel(const MidiEvent& ev) { return ev.status & 0x0f; }
+
+  static void play(Loop& loop, uint8_t layer, const MidiEvent& ev) {
+    loop.playingLayer = layer;
+    loop.player(ev);
+  }
+
+
+  static const uint8_t noNote = 0xff;
+
+  static void buildChain(Chain& c, uint8_t volume) {
+    for (int v = 0; v < 128; ++v) {
+      // bend the velocity curve: y = x + k x (1 - x), for k in [-1..1)
+      int32_t bent = v + c.curve * v * (127 - v) / (64 * 127);
+      c.velocities[v] = scaleVelocity(
+        static_cast<uint8_t>(clamp<int32_t>(bent, 0, 127)), volume);
+    }
+
+    for (int n = 0; n < 128; ++n) {
+      int t = n + c.transpose;
+      c.notes[n] = (n < c.lowNote || n > c.highNote || t < 0 || t > 127)
+        ? noNote : static_cast<uint8_t>(t);
+    }
+
+    c.builtVolume = volume;
+    c.stale = false;
+  }
+
+  static bool shape(Loop& loop, uint8_t layer, MidiEvent& ev) {
+    // apply the layer's chain to the event
+    // returns false if it shouldn't be played at all
+
+    if (layer >= layerLimit || ev.status >= 0xf0)
+      return true;
+
+    Chain& c = loop.chains[layer];
+    uint8_t volume = loop.scene.layerVolumes[layer];
+    if (c.stale || c.builtVolume != volume)
+      buildChain(c, volume);
+
+    if (ev.isNoteOn()) {
+      ev.data2 = c.velocities[ev.data2 & 0x7f];
+      if (ev.data2 == 0) return false;
+    }
+    if (ev.isNoteOn() || ev.isNoteOff()) {
+      uint8_t n = c.notes[ev.data1 & 0x7f];
+      if (n == noNote) return false;
+      ev.data1 = n;
+    }
+    if (c.channel != keepChannel)
+      ev.status = (ev.status & 0xf0) | c.channel;
+
+    return true;
+  }
+
+  static void startAwaitingOff(Loop& loop, Cell* cell,
+      const MidiEvent& played) {
     finishAwaitingOff(loop, cell->event);
-    auto& ao = loop.awaitingOff[cell->event.data1];
-    ao.cell = cell;
-    ao.start = loop.walltime;
+    auto ao = loop.awaitingOff.insert(channel(cell->event), cell->event.data1);
+    if (!ao) {
+      // full, as when NoteOffs have gone missing: the note held longest is
+      // ended now, as if its NoteOff had come, to make room
+      auto oldest = loop.awaitingOff.most(
+        [&](const AwaitOff& e) { return loop.walltime - e.start; });
+      if (oldest->played.status) {
+        MidiEvent off = { uint8_t(0x80 | channel(oldest->played)),
+          oldest->played.data1, 0 };
+        play(loop, oldest->cell->layer, off);
+      }
+      finishAwaitingOff(loop, oldest->cell->event);
+      loop.cutShort += 1;
+      ao = loop.awaitingOff.insert(channel(cell->event), cell->event.data1);
+    }
+    ao->cell = cell;
+    ao->start = loop.walltime;
+    ao->played = played;
+  }
+
+  static bool isAwaitingOff(Loop& loop, const Cell* cell) {
+    if (!cell->event.isNoteOn()) return false;
+    auto ao = loop.awaitingOff.find(channel(cell->event), cell->event.data1);
+    return ao && ao->cell == cell;
   }
 
   static void cancelAwatingOff(Loop& loop, const Cell* cell) {
-    auto& ao = loop.awaitingOff[cell->event.data1];
-    if (ao.cell == cell) {
-      ao.cell = nullptr;
-    }
+    auto ao = loop.awaitingOff.find(channel(cell->event), cell->event.data1);
+    if (ao && ao->cell == cell)
+      loop.awaitingOff.remove(ao);
   }
 
   static void finishAwaitingOff(Loop& loop, const MidiEvent& ev) {
-    auto& ao = loop.awaitingOff[ev.data1];
-    if (ao.cell) {
-      ao.cell->duration = loop.walltime - ao.start;
-      ao.cell = nullptr;
+    auto ao = loop.awaitingOff.find(channel(ev), ev.data1);
+    if (ao) {
+      AbsTime held = loop.walltime - ao->start;
+      ao->cell->duration =
+        static_cast<DeltaTime>(clamp<AbsTime>(held, 1, 0xffff));
+        // never 0, which is no duration at all, see playCell()
+      loop.awaitingOff.remove(ao);
+      loop.edits += 1;
     }
   }
 
   static void clearAwatingOff(Loop& loop) {
-    for (auto& ao : loop.awaitingOff)
-      ao = {nullptr, 0};
+    loop.awaitingOff.clear();
   }
 
 
+  static void endPendingOff(Loop& loop, const MidiEvent& ev) {
+    // a new note on the same pitch is starting, so end the pending one now,
+    // lest its NoteOff cut the new note short
+
+    auto po = loop.pendingOffIndex.find(channel(ev), ev.data1);
+    if (!po) return;
+
+    Cell* off = po->cell;
+    loop.pendingOffIndex.remove(po);
+
+    play(loop, off->layer, off->event);
+    off->event.status = 0;    // sent, so sendOffs() just frees it
+    off->duration = 1;
+  }
+
+  static void stealVoice(Loop& loop) {
+    // at full polyphony, the voice nearest its end makes way for a new one
+    Cell* v = nullptr;
+    for (Cell* p = loop.pendingOff; p; p = p->next())
+      if (p->event.status && (!v || p->duration < v->duration))
+        v = p;
+    if (v)
+      endPendingOff(loop, v->event);
+  }
+
+  static void endVoices(Loop& loop) {
+    // all notes off, for those the loop is sounding: sent as NoteOffs, as a
+    // CC 123 would also cut notes being held by the player
+    for (Cell* p = loop.pendingOff; p;) {
+      if (p->event.status)
+        play(loop, p->layer, p->event);
+      Cell* n = p->next();
+      p->free();
+      p = n;
+    }
+    loop.pendingOff = nullptr;
+    loop.playing = 0;
+    loop.pendingOffIndex.clear();
+  }
+
+  static bool thinControl(Loop& loop) {
+    // When cells run short, recorded control data is given up to make room:
+    // the CCs just ahead of the play cursor are the oldest in the loop.
+    // Only a bounded window is searched, so this is cheap enough to call
+    // from advance().
+
+    const int window = 64;
+    const int most = 4;
+
+    int thinned = 0;
+    Cell* p = loop.recentCell;
+    for (int i = 0; p && i < window && thinned < most; ++i) {
+      Cell* c = p->next();
+      if (!c || c == loop.recentCell || c == loop.firstCell)
+        break;
+
+      if (c->layer != startLayer && !c->event.isNoteOn()
+          && p->nextTime + c->nextTime <= 0xffff) {
+        p->link(c->next());
+        p->nextTime += c->nextTime;
+        c->free();
+        thinned += 1;
+      } else {
+        p = c;
+      }
+    }
+
+    if (thinned) {
+      loop.thinned += thinned;
+      loop.edits += 1;
+    }
+    return thinned > 0;
+  }
+
+  static Cell* alloc(Loop& loop, Cell::Priority pri) {
+    Cell* c = Cell::alloc(pri);
+    if (!c && pri != Cell::priorityControl && thinControl(loop))
+      c = Cell::alloc(pri);
+    return c;
+  }
+
+  static void measureRate(Loop& loop) {
+    // folds each second's count of recorded events into a smoothed rate
+    if (loop.walltime - loop.rateStart < 1000)
+      return;
+    loop.eventRate = (loop.eventRate * 3 + loop.rateCount * 16) / 4;
+    loop.rateCount = 0;
+    loop.rateStart = loop.walltime;
+  }
+
+  static void countDensity(Loop& loop, uint8_t layer, AbsTime pos, int n) {
+    // counts a NoteOn in, or out of, the column at pos in a closed loop
+    if (loop.firstCell || !loop.recentCell || layer >= layerLimit)
+      return;
+    uint32_t col = std::min<uint32_t>(
+      pos * densityColumns / loop.length, densityColumns - 1);
+      // pos can equal length, for events just before the start cell
+    uint8_t& count = loop.density.notes[layer][col];
+    count = clamp<int>(count + n, 0, 255);
+    loop.density.changes[col] += 1;
+  }
+
+  static void clearDensity(Loop& loop) {
+    for (auto& l : loop.density.notes) l.fill(0);
+    for (auto& c : loop.density.changes) c += 1;
+  }
+
+  static void fitToBeat(Loop& loop) {
+    // Called as the first pass is closed, with recentCell linked back to
+    // firstCell, the start. If the fitted length is longer, the wait before
+    // the start is stretched. If it is shorter, the start was passed a
+    // little while ago: what was recorded since is dropped, as it was the
+    // start being played again, and the cursor moves to where the loop would
+    // be now.
+
+    AbsTime onsets[maxOnsets];
+    uint16_t count = 0;
+    AbsTime pos = 0;
+    Cell* c = loop.firstCell;
+    do {
+      if (c->layer != startLayer && c->event.isNoteOn())
+        onsets[count++] = pos;
+      pos += c->nextTime;
+      c = c->next();
+    } while (c != loop.firstCell && count < maxOnsets);
+
+    AbsTime fitted = fitLoopLength(onsets, count, loop.length);
+    if (fitted > loop.length) {
+      loop.recentCell->nextTime += fitted - loop.length;
+      loop.length = fitted;
+      return;
+    }
+    if (fitted == loop.length)
+      return;
+
+    AbsTime late = loop.length - fitted;
+
+    Cell* last = loop.firstCell;
+    pos = 0;
+    while (last->next() != loop.firstCell
+        && pos + last->nextTime < fitted) {
+      pos += last->nextTime;
+      last = last->next();
+    }
+    for (c = last->next(); c != loop.firstCell;) {
+      Cell* doomed = c;
+      c = c->next();
+      if (doomed->event.isNoteOn())
+        cancelAwatingOff(loop, doomed);
+      doomed->free();
+    }
+    last->link(loop.firstCell);
+    last->nextTime = fitted - pos;
+
+    Cell* at = loop.firstCell;
+    pos = 0;
+    while (at->next() != loop.firstCell && pos + at->nextTime <= late) {
+      pos += at->nextTime;
+      at = at->next();
+    }
+    loop.recentCell = at;
+    loop.timeSinceRecent = late - pos;
+    loop.length = fitted;
+    loop.position = late;
+  }
+
+  static AbsTime nextOff(const Loop& loop) {
+    AbsTime t = noOff;
+    for (const Cell* p = loop.pendingOff; p; p = p->next())
+      t = std::min<AbsTime>(t, p->duration);
+    return t;
+  }
+
+  static AbsTime sendOffs(Loop& loop, AbsTime dt) {
+    // returns time until the next NoteOff after these
+
+    AbsTime t = noOff;
+    for (Cell *p = loop.pendingOff, *q = nullptr; p;) {
+      if (dt < p->duration) {
+        p->duration -= dt;
+        t = std::min<AbsTime>(t, p->duration);
+        q = p;
+        p = p->next();
+      } else {
+        if (p->event.status) {
+          play(loop, p->layer, p->event);
+          auto po = loop.pendingOffIndex.find(channel(p->event), p->event.data1);
+          if (po && po->cell == p)
+            loop.pendingOffIndex.remove(po);
+        }
+
+        Cell* n = p->next();
+        p->free();
+        loop.playing -= 1;
+
+        if (q)  q->link(n);
+        else    loop.pendingOff = n;
+        p = n;
+      }
+    }
+    return t;
+  }
+
   static void playCell(Loop& loop, const Cell& cell) {
     auto layer = cell.layer;
-    if (layer < loop.layerMutes.size() && loop.layerMutes[layer])
+    const Scene& scene = loop.scene;
+    if (layer < layerLimit
+        && (scene.layerMutes[layer] || !(scene.layerEnables & (1 << layer))))
       return;
 
-    if (cell.event.isNoteOn() && cell.duration > 0) {
+    if (cell.event.isNoteOn()) {
+      if (cell.duration == 0)
+        return;   // see the voices, in looper.h
+
       MidiEvent note = cell.event;
-      if (layer < loop.layerVolumes.size())
-        note.data2 = scaleVelocity(note.data2, loop.layerVolumes[layer]);
-      if (note.data2 == 0)
+      if (!shape(loop, layer, note))
         return;
 
-      Cell* offCell = Cell::alloc();
+      Cell* offCell = alloc(loop, Cell::priorityOff);
       if (!offCell)
         return;   // don't play NoteOn if can't allocate NoteOff
 
-      loop.player(note);
-
+      endPendingOff(loop, note);
+      auto po = loop.pendingOffIndex.insert(channel(note), note.data1);
+      if (!po) {
+        stealVoice(loop);
+        po = loop.pendingOffIndex.insert(channel(note), note.data1);
+        if (!po) {
+          offCell->free();
+          return;
+        }
+      }
+      po->cell = offCell;
+      play(loop, layer, note);
+
+      DeltaTime duration = cell.duration;
+      if (!loop.firstCell && duration > loop.length)
+        duration = static_cast<DeltaTime>(loop.length);
+          // once the loop is closed, a note can't outlast it
+
+      offCell->layer = layer;
       offCell->event = note;
       offCell->event.data2 = 0; // volume 0 makes it a NoteOff
-      offCell->duration = cell.duration;
+      offCell->duration = duration;
       offCell->link(loop.pendingOff);
       loop.pendingOff = offCell;
+      loop.playing += 1;
     } else {
-      loop.player(cell.event);
+      MidiEvent ev = cell.event;
+      if (shape(loop, layer, ev))
+        play(loop, layer, ev);
     }
   }
 };
@@ -82,97 +390,164 @@ public:
 
 Loop::Loop(EventFunc func)
   : player(func),
-    walltime(0),
-    armed(true), layerCount(1), activeLayer(0), layerArmed(false),
+    walltime(0), playingLayer(0),
+    armed(true), layerCount(1), activeLayer(0), layerArmed(false), armedTime(0),
+    overdubbing(false), fitLength(false), recordPaused(false),
     firstCell(nullptr), recentCell(nullptr),
     timeSinceRecent(0), length(0), position(0),
-    pendingOff(nullptr)
+    pendingOff(nullptr),
+    edits(0), thinned(0), dropped(0), cutShort(0), playing(0),
+    rateStart(0), rateCount(0), eventRate(0)
   {
-    for (auto& m : layerMutes) m = false;
-    for (auto& v : layerVolumes) v = 100;
+    density.changes.fill(0);
+    Util::clearDensity(*this);
+
+    for (auto& sc : scenes) {
+      for (auto& m : sc.layerMutes) m = false;
+      for (auto& v : sc.layerVolumes) v = 100;
+      sc.layerEnables = 0xffff;
+    }
+    scene = scenes[0];
+    sceneIndex = 0;
+    pendingScene = nullptr;
+
+    for (auto& c : chains) {
+      c.curve = 0;
+      c.transpose = 0;
+      c.channel = keepChannel;
+      c.lowNote = 0;
+      c.highNote = 127;
+      c.stale = true;
+    }
 
     Util::clearAwatingOff(*this);
   }
 
 
 void Loop::advance(AbsTime now) {
-  // In theory the offs should be interleaved as we go through the next
-  // set of cells to play. BUT, since dt has already elapsed, it is roughly
-  // okay to just spit out the NoteOff events first. And anyway, dt is rarely
-  // more than 1.
+  // Time is advanced in steps that end at each cell to be played, or NoteOff
+  // to be sent, whichever comes first. So the output is in order, and
+  // time() is right as each event is played, even when dt is large, as when
+  // rendering offline.
 
   AbsTime dt = now - walltime;
-  walltime = now;
     // FIXME: Handle rollover of walltime?
 
-  for (Cell *p = pendingOff, *q = nullptr; p;) {
-    if (dt < p->duration) {
-      p->duration -= dt;
-      q = p;
-      p = p->next();
-    } else {
-      player(p->event);
+  Util::measureRate(*this);
 
-      Cell* n = p->next();
-      p->free();
+  AbsTime untilOff = Util::nextOff(*this);
 
-      if (q)  q->link(n);
-      else    pendingOff = n;
-      p = n;
+  while (true) {
+    AbsTime step = std::min(dt, untilOff);
+    bool reachedNext = false;
+
+    if (recentCell && !recentCell->atEnd()) {
+      AbsTime untilNext = recentCell->nextTime - timeSinceRecent;
+      if (untilNext <= step) {
+        step = untilNext;
+        reachedNext = true;
+      }
     }
-  }
 
-  if (!recentCell) return;
+    dt -= step;
+    walltime += step;
+    if (step > 0)
+      untilOff = Util::sendOffs(*this, step);
 
-  if (recentCell->atEnd()) {
-    if (dt > maxEventInterval - timeSinceRecent) {
-      clear();
-      return;
+    if (recentCell && recentCell->atEnd()) {
+      if (step > maxEventInterval - timeSinceRecent) {
+        clear();
+        return;
+      }
+
+      length += step;
     }
 
-    timeSinceRecent += dt;
-    length += dt;
-    position += dt;
-    return;
-  }
-  position = (position + dt) % length;
+    if (recentCell) {
+      timeSinceRecent += step;
+      position += step;
+    }
+
+    if (!reachedNext) {
+      if (dt == 0) return;
+      continue;
+    }
 
-  while (recentCell->nextTime <= timeSinceRecent + dt) {
     // time to move to the next event, and play it
 
     Cell* nextCell = recentCell->next();
     auto layer = nextCell->layer;
 
-    if (layer == activeLayer && !layerArmed) {
+    if (layer == startLayer) {
+      position = 0;
+      if (pendingScene) {
+        // wrapping to the start of the loop, switch scenes on the downbeat
+        scene = *pendingScene;
+        sceneIndex = static_cast<uint8_t>(pendingScene - &scenes[0]);
+        pendingScene = nullptr;
+      }
+    }
+
+    if (layer == activeLayer && !layerArmed && !overdubbing
+        && !Util::isAwaitingOff(*this, nextCell)) {
       // prior data from this layer currently recording into, delete it
       // note: if the layer is armed, then awaiting first event to start
       // recording
-      if (nextCell->event.isNoteOn())
+      // note: when overdubbing, prior data is kept, and played
+      // note: a note recorded a whole loop ago, and still held, isn't prior
+      // data, it is kept, and passed over
+      if (nextCell->event.isNoteOn()) {
         Util::cancelAwatingOff(*this, nextCell);
+        Util::countDensity(*this, layer, position, -1);
+      }
 
       recentCell->link(nextCell->next());
       recentCell->nextTime += nextCell->nextTime;
       nextCell->free();
+      edits += 1;
     } else {
-      dt -= recentCell->nextTime - timeSinceRecent;
       timeSinceRecent = 0;
       recentCell = nextCell;
       Util::playCell(*this, *recentCell);
+      if (pendingOff)
+        untilOff = std::min<AbsTime>(untilOff, pendingOff->duration);
+          // playCell() adds any new NoteOff at the head of the list
     }
   }
-
-  timeSinceRecent += dt;
 }
 
 
 void Loop::addEvent(const MidiEvent& ev) {
   if (ev.isNoteOff()) {
-    // note off processing
-    player(ev);
+    // note off processing: end the note as it was played, even if the layer,
+    // or its shaping, has changed since, as when kept while held
+    MidiEvent off = ev;
+    auto ao = awaitingOff.find(Util::channel(ev), ev.data1);
+    if (ao) {
+      if (ao->played.status) {
+        off.status = (ev.status & 0xf0) | Util::channel(ao->played);
+        off.data1 = ao->played.data1;
+        Util::play(*this, ao->cell->layer, off);
+      }
+    } else if (Util::shape(*this, activeLayer, off))
+      Util::play(*this, activeLayer, off);
+      // FIXME: with no record of the NoteOn, as when cleared since, this
+      // may not end the note that was played
     Util::finishAwaitingOff(*this, ev);
     return;
   }
 
+  if (recordPaused) {
+    // played as if it were recorded, but the loop is left as it is
+    MidiEvent out = ev;
+    if (Util::shape(*this, activeLayer, out)) {
+      if (out.isNoteOn())
+        Util::endPendingOff(*this, out);
+      Util::play(*this, activeLayer, out);
+    }
+    return;
+  }
+
   if (armed) {
     clear();
     armed = false;
@@ -181,36 +556,39 @@ void Loop::addEvent(const MidiEvent& ev) {
     layerArmed = false;
   }
 
-  if (activeLayer < layerMutes.size())
-    layerMutes[activeLayer] = false;
+  scene.layerMutes[activeLayer] = false;
+  scene.layerEnables |= 1 << activeLayer;
     // TODO: Should we be doing this? how to communicate back to controller?
 
-  if (ev.isNoteOn()) {
-    MidiEvent note = ev;
-    if (activeLayer < layerVolumes.size())
-      note.data2 = scaleVelocity(note.data2, layerVolumes[activeLayer]);
-    player(note);
-  } else {
-    player(ev);
+  MidiEvent out = ev;
+  if (Util::shape(*this, activeLayer, out)) {
+    if (out.isNoteOn())
+      Util::endPendingOff(*this, out);
+    Util::play(*this, activeLayer, out);
+  } else
+    out.status = 0;
+
+  Cell* newCell = Util::alloc(*this,
+    ev.isNoteOn() ? Cell::priorityRecord : Cell::priorityControl);
+  if (!newCell) {
+    dropped += 1;   // ran out of cells!
+    return;
   }
-
-  Cell* newCell = Cell::alloc();
-  if (!newCell) return; // ran out of cells!
   newCell->event = ev;
   newCell->layer = activeLayer;
   newCell->duration = 0;
+  rateCount += 1;
 
   if (ev.isNoteOn())
-    Util::startAwaitingOff(*this, newCell);
+    Util::startAwaitingOff(*this, newCell, out);
 
   if (!recentCell) {
     // first time through, add the "start" note
-    Cell* startCell = Cell::alloc();
+    Cell* startCell = Cell::alloc(Cell::priorityRecord);
     if (startCell) {
-      startCell->event = { 0x90, 48, 100 };
-        // FIXME: should be defined somewhere
-      startCell->layer = 0xff; // a magic layer!
-      startCell->duration = 3;
+      startCell->event = startEvent;
+      startCell->layer = startLayer;
+      startCell->duration = startDuration;
 
       recentCell = startCell;
       firstCell = recentCell;
@@ -219,11 +597,12 @@ void Loop::addEvent(const MidiEvent& ev) {
   }
 
   if (recentCell) {
+    // insert after the play cursor, splitting the time to the following cell
+    // between the cursor and the new cell: timeSinceRecent is always less than
+    // recentCell->nextTime here, as advance() would have moved past it.
     Cell* nextCell = recentCell->next();
-    if (nextCell) {
-      newCell->link(nextCell);
-      newCell->nextTime = recentCell->nextTime - timeSinceRecent;
-    }
+    newCell->link(nextCell);
+    newCell->nextTime = nextCell ? recentCell->nextTime - timeSinceRecent : 0;
 
     recentCell->link(newCell);
     recentCell->nextTime = timeSinceRecent;
@@ -234,18 +613,31 @@ void Loop::addEvent(const MidiEvent& ev) {
 
   recentCell = newCell;
   timeSinceRecent = 0;
+  edits += 1;
+
+  if (ev.isNoteOn())
+    Util::countDensity(*this, activeLayer, position, 1);
 }
 
 
 void Loop::keep() {
   if (firstCell) {
     // closing the loop
+    if (length == 0) {
+      // a loop must take some time, or advance() would never leave it
+      timeSinceRecent = 1;
+      length = 1;
+    }
     recentCell->link(firstCell);
     recentCell->nextTime = timeSinceRecent;
+    if (fitLength)
+      Util::fitToBeat(*this);
     firstCell = nullptr;
+    edits += 1;
+    rebuildDensity();
   }
 
-  activeLayer += activeLayer < (layerMutes.size() - 1) ? 1 : 0;
+  activeLayer += activeLayer < (layerLimit - 1) ? 1 : 0;
   layerArmed = true;
   layerCount = std::max<uint8_t>(layerCount, activeLayer + 1);
 
@@ -258,17 +650,20 @@ void Loop::arm() {
 }
 
 void Loop::clear() {
-  Cell* start = recentCell;
+  Cell* start = firstCell ? firstCell : recentCell;
+    // until the loop is closed, it isn't a ring, and starts at firstCell
 
-  while (recentCell) {
-    Cell* doomed = recentCell;
-    recentCell = doomed->next();
+  for (Cell* c = start; c;) {
+    Cell* doomed = c;
+    c = doomed->next();
     doomed->free();
-    if (recentCell == start)
+    if (c == start)
       break;
   }
 
   Util::clearAwatingOff(*this);
+  Util::clearDensity(*this);
+  Util::endVoices(*this);
 
   firstCell = nullptr;
   recentCell = nullptr;
@@ -279,20 +674,62 @@ void Loop::clear() {
   layerCount = 1;
   activeLayer = 0;
   layerArmed = true;
-  for (auto& m : layerMutes) m = false;
+  for (auto& m : scene.layerMutes) m = false;
+  scene.layerEnables = 0xffff;
     // TODO: Should we be doing this? how to communicate back to controller?
+    // the stored scenes are left as they are
+  pendingScene = nullptr;
+  edits += 1;
 }
 
 
 void Loop::layerMute(uint8_t layer, bool muted) {
-  if (layer < layerMutes.size()) layerMutes[layer] = muted;
+  if (layer < layerLimit) scene.layerMutes[layer] = muted;
 }
 
 void Loop::layerVolume(uint8_t layer, uint8_t volume) {
-  if (layer < layerVolumes.size()) layerVolumes[layer] = volume;
+  if (layer < layerLimit) scene.layerVolumes[layer] = volume;
+}
+
+void Loop::layerCurve(uint8_t layer, int8_t curve) {
+  if (layer >= layerLimit) return;
+  chains[layer].curve = curve;
+  chains[layer].stale = true;
+}
+
+void Loop::layerTranspose(uint8_t layer, int8_t semitones) {
+  if (layer >= layerLimit) return;
+  chains[layer].transpose = semitones;
+  chains[layer].stale = true;
+}
+
+void Loop::layerChannel(uint8_t layer, uint8_t channel) {
+  if (layer >= layerLimit) return;
+  chains[layer].channel = channel == keepChannel ? channel : channel & 0x0f;
+}
+
+void Loop::layerLowNote(uint8_t layer, uint8_t note) {
+  if (layer >= layerLimit) return;
+  chains[layer].lowNote = note;
+  chains[layer].stale = true;
+}
+
+void Loop::layerHighNote(uint8_t layer, uint8_t note) {
+  if (layer >= layerLimit) return;
+  chains[layer].highNote = note;
+  chains[layer].stale = true;
+}
+
+void Loop::layerEnable(uint8_t layer, bool enabled) {
+  if (layer >= layerLimit) return;
+  if (enabled)  scene.layerEnables |= 1 << layer;
+  else          scene.layerEnables &= ~(1 << layer);
 }
 
 void Loop::layerArm(uint8_t layer) {
+  if (layer >= layerLimit) return;
+    // so activeLayer is always a layer there is room for
+
   if (layerArmed && activeLayer == layer && walltime < (armedTime + 1000)) {
     // if a duouble press of the layer arm control, start recording
     layerArmed = false;
@@ -307,6 +744,35 @@ void Loop::layerArm(uint8_t layer) {
   layerCount = std::max<uint8_t>(layerCount, activeLayer + 1);
 }
 
+void Loop::overdub(bool on) {
+  overdubbing = on;
+}
+
+void Loop::autoLength(bool on) {
+  fitLength = on;
+}
+
+void Loop::recordPause(bool on) {
+  recordPaused = on;
+}
+
+void Loop::sceneStore(uint8_t n) {
+  if (n < scenes.size()) scenes[n] = scene;
+}
+
+void Loop::sceneRecall(uint8_t n) {
+  if (n >= scenes.size()) return;
+
+  if (firstCell || !recentCell) {
+    // not looping yet, so there is no loop start to wait for
+    scene = scenes[n];
+    sceneIndex = n;
+    pendingScene = nullptr;
+  } else {
+    pendingScene = &scenes[n];
+  }
+}
+
 Loop::Status Loop::status() const {
   Status s;
   s.length = length;
@@ -316,10 +782,65 @@ Loop::Status Loop::status() const {
   s.looping = !firstCell;
   s.armed = armed;
   s.layerArmed = layerArmed;
-  s.layerMutes = layerMutes;
+  s.overdubbing = overdubbing;
+  s.autoLength = fitLength;
+  s.scene = sceneIndex;
+  s.scenePending = pendingScene != nullptr;
+  s.layerMutes = scene.layerMutes;
+  s.cellsThinned = thinned;
+  s.eventsDropped = dropped;
+  s.notesCutShort = cutShort;
+
+  s.cellsTotal = Cell::capacity();
+  s.cellsFree = Cell::freeCount();
+  s.cellsPlaying = playing;
+  s.cellsRecorded = s.cellsTotal - s.cellsFree - playing;
+  s.cellsMostUsed = Cell::mostUsed();
+  s.cellsFailed = 0;
+  for (int p = 0; p < Cell::priorityCount; ++p)
+    s.cellsFailed += Cell::failures(Cell::Priority(p));
+
+  uint16_t room = Cell::reserved(Cell::priorityRecord);
+  room = s.cellsFree > room ? s.cellsFree - room : 0;
+  s.recordTimeLeft = eventRate
+    ? std::min<uint32_t>(uint32_t(room) * 16 / eventRate, 0xfffe)
+    : 0xffff;
+
+  s.density = &density;
   return s;
 }
 
+const Cell* Loop::loopStart() const {
+  if (!recentCell || firstCell)
+    return nullptr;
+
+  const Cell* c = recentCell;
+  do {
+    c = c->next();
+    if (c->layer == startLayer)
+      return c;
+  } while (c != recentCell);
+
+  return recentCell->next();
+    // no start cell could be allocated, so any place will do
+}
+
+void Loop::rebuildDensity() {
+  Util::clearDensity(*this);
+
+  const Cell* start = loopStart();
+  if (!start) return;
+
+  AbsTime pos = 0;
+  const Cell* c = start;
+  do {
+    if (c->event.isNoteOn())
+      Util::countDensity(*this, c->layer, pos, 1);
+    pos += c->nextTime;
+    c = c->next();
+  } while (c != start);
+}
+
 void Loop::begin() {
   Cell::begin();
 }
@@ -5,12 +5,20 @@
 #include <cstdint>
 
 #include "cell.h"
+#include "config.h"
+#include "notetable.h"
 #include "types.h"
 
 
 const DeltaTime maxEventInterval = 20000;
   // maximum amount of time spent waiting for a new event
 
+const uint8_t startLayer = 0xff;
+  // the magic layer of the cell that starts the loop
+const MidiEvent startEvent = { 0x90, 48, 100 };
+const DeltaTime startDuration = 3;
+  // what the start cell plays
+
 
 typedef void (*EventFunc)(const MidiEvent&);
   // TODO: Needs time somehow? delta? absolute?
@@ -31,6 +39,37 @@ public:
   void layerMute(uint8_t layer, bool muted);
   void layerVolume(uint8_t layer, uint8_t volume);
   void layerArm(uint8_t layer);   // start overwriting this layer on next event
+  void overdub(bool);   // keep prior material in the active layer, add to it
+  void autoLength(bool);  // fit the first pass to the beat as it is kept,
+                          // see beatfit.h
+  void recordPause(bool); // play what is played, but don't record it, as
+                          // while a file is transferred, see transfer.h
+  void layerEnable(uint8_t layer, bool enabled);
+
+  static const uint8_t layerLimit = config.layers;
+
+  // shaping of each layer's output, applied as it plays
+  static const uint8_t keepChannel = 0xff;
+  void layerCurve(uint8_t layer, int8_t curve);   // velocity, 0 is straight
+  void layerTranspose(uint8_t layer, int8_t semitones);
+  void layerChannel(uint8_t layer, uint8_t channel);  // 0 ~ 15, or keepChannel
+  void layerLowNote(uint8_t layer, uint8_t note);     // notes outside the
+  void layerHighNote(uint8_t layer, uint8_t note);    // range aren't played
+
+  static const uint8_t sceneCount = 4;
+  void sceneStore(uint8_t scene);   // copy current mutes, volumes & enables
+  void sceneRecall(uint8_t scene);  // switch to scene at start of next loop
+
+  // Where the notes fall in the loop, for display: the NoteOns of each layer,
+  // counted into columns across the loop. It is kept up to date as notes are
+  // recorded and overwritten, so it never has to be worked out from the cells.
+  // It is empty until the loop is closed.
+  static const uint8_t densityColumns = 112;
+  struct Density {
+    std::array<std::array<uint8_t, densityColumns>, layerLimit> notes;
+                                                // saturating at 255
+    std::array<uint8_t, densityColumns> changes;  // bumped as a column changes
+  };
 
 
   struct Status {
@@ -41,17 +80,52 @@ public:
     bool        looping;
     bool        armed;
     bool        layerArmed;
-    std::array<bool, 9> layerMutes;
+    bool        overdubbing;
+    bool        autoLength;
+    uint8_t     scene;
+    bool        scenePending;
+    std::array<bool, layerLimit> layerMutes;
+    uint16_t    cellsThinned;   // control data given up for room
+    uint16_t    eventsDropped;  // events that couldn't be recorded
+    uint16_t    notesCutShort;  // held notes ended to track new ones, as
+                                // when NoteOffs go missing
+
+    uint16_t    cellsTotal;
+    uint16_t    cellsFree;
+    uint16_t    cellsRecorded;  // in the loop, or being recorded
+    uint16_t    cellsPlaying;   // NoteOffs waiting to be sent
+    uint16_t    cellsMostUsed;  // high water mark
+    uint16_t    cellsFailed;    // allocations that failed, for any use
+    uint16_t    recordTimeLeft; // seconds, at the recent rate of recording
+                                // 0xffff if nothing is being recorded
+
+    const Density* density;
  };
 
   Status status() const;
 
+  uint16_t editCount() const { return edits; }
+    // changes with every change to the cells in the loop
+
+  AbsTime time() const { return walltime; }
+    // during advance(), the time of the event being played
+  uint8_t layer() const { return playingLayer; }
+    // likewise, the layer it was recorded on, or startLayer for the start
+    // note, and for events played as they are recorded, the active layer
+
   static void begin();
 
+  class Writer;   // serialize to, and restore from, a loop image
+  class Reader;   // see loopimage.h
+
+  class SmfWriter;  // export to, and import from, Standard MIDI Files
+  class SmfReader;  // see smf.h
+
 private:
   const EventFunc player;
 
   AbsTime   walltime;
+  uint8_t   playingLayer;
 
   bool      armed;
 
@@ -59,9 +133,41 @@ private:
   uint8_t activeLayer;
   bool layerArmed;
   AbsTime armedTime;
+  bool overdubbing;
+  bool fitLength;
+  bool recordPaused;
+
+  struct Scene {
+    std::array<bool, layerLimit> layerMutes;
+    std::array<uint8_t, layerLimit> layerVolumes;
+    uint16_t layerEnables;    // bit per layer, disabled layers don't play
+  };
 
-  std::array<bool, 9> layerMutes;
-  std::array<uint8_t, 9> layerVolumes;
+  // The scene playing is a working copy: mutes, volumes, and enables change
+  // it, and not the stored scene it was recalled from, which only changes
+  // when stored to.
+  std::array<Scene, sceneCount> scenes;
+  Scene scene;            // the scene currently playing
+  uint8_t sceneIndex;     // the stored scene it was last recalled from
+  Scene* pendingScene;    // if set, copied to scene at the start of the loop
+
+  // The shaping of a layer is compiled into tables, so playing an event costs
+  // the same table reads however much shaping there is. They're rebuilt when
+  // a setting, or the layer's volume in the current scene, changes.
+  struct Chain {
+    int8_t curve;
+    int8_t transpose;
+    uint8_t channel;
+    uint8_t lowNote;
+    uint8_t highNote;
+
+    bool stale;
+    uint8_t builtVolume;
+    std::array<uint8_t, 128> velocities;  // 0 for notes not to play
+    std::array<uint8_t, 128> notes;       // 0xff for notes not to play
+  };
+
+  std::array<Chain, layerLimit> chains;
 
   Cell* firstCell;
   Cell* recentCell;
@@ -71,16 +177,58 @@ private:
   AbsTime position;
 
   struct AwaitOff {
-    Cell* cell;
+    Cell* cell;       // recorded NoteOn, awaiting its NoteOff to set duration
     AbsTime start;
+    MidiEvent played; // the NoteOn as shaped and played, status 0 if not
+  };
+
+  struct PendingOff {
+    Cell* cell;       // NoteOff in the pendingOff list
   };
 
-  std::array<AwaitOff, 128> awaitingOff;
+  // Notes are tracked by channel and note in small tables sized for the
+  // polyphony actually played, rather than by note alone in arrays of 128:
+  // on SAMD21, 384 + 128 bytes per loop, where awaitingOff was 1024 bytes.
+  //
+  // Each note the loop is sounding is a voice: a NoteOff in the pendingOff
+  // list, and its entry in pendingOffIndex. Every voice has an entry, so a
+  // note can always be ended early, and there are never more voices than
+  // the index holds, which bounds the work of each step of advance():
+  //  - a note started on a pitch already sounding ends that voice first
+  //  - at full polyphony, the voice nearest its end is stolen
+  //  - notes held longer than the loop are cut at its length, so each pass
+  //    ends just as the next starts
+  //  - a NoteOn yet to hear its NoteOff isn't played: it is still held, or
+  //    its NoteOff was lost, and either way nothing would end it
+  //  - clear() ends every voice at once
+  NoteTable<AwaitOff, config.noteSlots> awaitingOff;
+  NoteTable<PendingOff, config.noteSlots> pendingOffIndex;
 
   Cell* pendingOff;
 
+  uint16_t edits;   // bumped on every change to the cells in the loop
+  uint16_t thinned;
+  uint16_t dropped;
+  uint16_t cutShort;
+  uint16_t playing;   // cells in pendingOff
+
+  AbsTime rateStart;
+  uint16_t rateCount;     // events recorded since rateStart
+  uint16_t eventRate;     // per second, in 1/16ths, smoothed
+
+  Density density;
+
+  const Cell* loopStart() const;
+    // the start cell of a closed loop, or nullptr if not looping
+  void rebuildDensity();
+    // count density afresh from the cells, as when a loop is closed or loaded
+
   class Util;
   friend class Util;
+  friend class Writer;
+  friend class Reader;
+  friend class SmfWriter;
+  friend class SmfReader;
 };
 
 
@@ -0,0 +1,312 @@
+#include "loopimage.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "cell.h"
+
+#if !defined(ARDUINO)
+#include <cstdio>
+#endif
+
+
+namespace {
+  struct Header {
+    uint32_t  magic;
+    uint16_t  version;
+    uint16_t  cellCount;
+    AbsTime   length;
+    uint8_t   layerCount;
+    uint8_t   activeLayer;
+    uint8_t   scene;
+    uint8_t   sceneCount;
+  };
+
+  const size_t maxImageLayers = 16;
+
+  struct SceneRecord {
+    uint16_t  layerMutes;     // bit per layer
+    uint16_t  layerEnables;   // bit per layer
+    uint8_t   layerVolumes[maxImageLayers];
+  };
+
+  struct CellRecord {
+    uint8_t   layer;
+    MidiEvent event;
+    DeltaTime duration;
+    DeltaTime nextTime;
+  };
+
+  static_assert(sizeof(Header) == 16, "image header layout changed");
+  static_assert(sizeof(SceneRecord) == 20, "image scene layout changed");
+  static_assert(sizeof(CellRecord) == 8, "image cell layout changed");
+  static_assert(Loop::layerLimit <= maxImageLayers,
+    "image scenes have room for 16 layers");
+}
+
+
+Loop::Writer::Writer(const Loop& l)
+  : loop(l), edits(l.edits),
+    startCell(l.loopStart()),
+    nextCell(nullptr), cellCount(0), scenesStaged(0),
+    stageLen(0), stagePos(0)
+{
+  // only a closed loop is written, a loop still recording its first pass
+  // is written as empty
+
+  if (startCell) {
+    const Cell* c = startCell;
+    do {
+      cellCount += 1;
+      c = c->next();
+    } while (c != startCell);
+  }
+
+  Header h;
+  h.magic = LoopImage::magic;
+  h.version = LoopImage::version;
+  h.cellCount = cellCount;
+  h.length = startCell ? loop.length : 0;
+  h.layerCount = loop.layerCount;
+  h.activeLayer = loop.activeLayer;
+  h.scene = loop.sceneIndex;
+  h.sceneCount = loop.scenes.size() + 1;
+    // the stored scenes, then the one playing
+
+  std::memcpy(stage, &h, sizeof(h));
+  stageLen = sizeof(h);
+}
+
+size_t Loop::Writer::size() const {
+  return sizeof(Header)
+    + (loop.scenes.size() + 1) * sizeof(SceneRecord)
+    + cellCount * sizeof(CellRecord);
+}
+
+bool Loop::Writer::stageNext() {
+  if (scenesStaged <= loop.scenes.size()) {
+    const Scene& sc = scenesStaged < loop.scenes.size()
+      ? loop.scenes[scenesStaged] : loop.scene;
+    scenesStaged += 1;
+    SceneRecord r = { 0, 0, { 0 } };
+    for (size_t i = 0; i < Loop::layerLimit; ++i) {
+      if (sc.layerMutes[i])             r.layerMutes |= 1 << i;
+      if (sc.layerEnables & (1 << i))   r.layerEnables |= 1 << i;
+      r.layerVolumes[i] = sc.layerVolumes[i];
+    }
+    std::memcpy(stage, &r, sizeof(r));
+    stageLen = sizeof(r);
+    stagePos = 0;
+    return true;
+  }
+
+  if (!startCell)
+    return false;
+
+  if (!nextCell)                            nextCell = startCell;
+  else if (nextCell->next() == startCell)   return false;
+  else                                      nextCell = nextCell->next();
+
+  CellRecord r;
+  r.layer = nextCell->layer;
+  r.event = nextCell->event;
+  r.duration = nextCell->duration;
+  r.nextTime = nextCell->nextTime;
+  std::memcpy(stage, &r, sizeof(r));
+  stageLen = sizeof(r);
+  stagePos = 0;
+  return true;
+}
+
+size_t Loop::Writer::read(uint8_t* buf, size_t len) {
+  size_t n = 0;
+  while (n < len) {
+    if (stagePos == stageLen && !stageNext())
+      break;
+    size_t k = std::min(len - n, stageLen - stagePos);
+    std::memcpy(buf + n, stage + stagePos, k);
+    n += k;
+    stagePos += k;
+  }
+  return n;
+}
+
+
+Loop::Reader::Reader(Loop& l)
+  : loop(l), phase(header),
+    sceneCount(0), scenesRead(0), cellCount(0), cellsRead(0),
+    firstCell(nullptr), lastCell(nullptr),
+    stageLen(sizeof(Header)), stagePos(0)
+  { }
+
+void Loop::Reader::startPhase(Phase p) {
+  // skip over empty sections
+  if (p == scenes && scenesRead == sceneCount)  p = cells;
+  if (p == cells && cellsRead == cellCount)     p = done;
+
+  phase = p;
+  stagePos = 0;
+  switch (phase) {
+    case header:  stageLen = sizeof(Header);        break;
+    case scenes:  stageLen = sizeof(SceneRecord);   break;
+    case cells:   stageLen = sizeof(CellRecord);    break;
+    default:      stageLen = 0;                     break;
+  }
+}
+
+void Loop::Reader::unstage() {
+  switch (phase) {
+    case header: {
+      Header h;
+      std::memcpy(&h, stage, sizeof(h));
+      if (h.magic != LoopImage::magic || h.version != LoopImage::version) {
+        abandon();
+        return;
+      }
+
+      loop.clear();
+      loop.length = h.length;
+      loop.layerCount = std::max<uint8_t>(1,
+        std::min(h.layerCount, uint8_t(Loop::layerLimit)));
+      loop.activeLayer = std::min<uint8_t>(h.activeLayer, loop.layerCount - 1);
+      loop.sceneIndex = h.scene < loop.scenes.size() ? h.scene : 0;
+
+      sceneCount = h.sceneCount;
+      cellCount = h.cellCount;
+      startPhase(scenes);
+      return;
+    }
+
+    case scenes: {
+      SceneRecord r;
+      std::memcpy(&r, stage, sizeof(r));
+      Scene* sc = nullptr;
+      if (scenesRead < loop.scenes.size())       sc = &loop.scenes[scenesRead];
+      else if (scenesRead == loop.scenes.size()) sc = &loop.scene;
+        // images from before the scene playing was saved don't have this one
+      if (sc) {
+        for (size_t i = 0; i < Loop::layerLimit; ++i) {
+          sc->layerMutes[i] = r.layerMutes & (1 << i);
+          if (r.layerEnables & (1 << i))  sc->layerEnables |= 1 << i;
+          else                            sc->layerEnables &= ~(1 << i);
+          sc->layerVolumes[i] = r.layerVolumes[i];
+        }
+        if (scenesRead == loop.sceneIndex)
+          loop.scene = *sc;
+          // until the scene playing is read, if there is one
+      }
+      scenesRead += 1;
+      startPhase(scenes);
+      return;
+    }
+
+    case cells: {
+      CellRecord r;
+      std::memcpy(&r, stage, sizeof(r));
+
+      Cell* c = Cell::alloc(Cell::priorityRecord);
+      if (!c) {
+        abandon();
+        return;
+      }
+      c->layer = r.layer;
+      c->event = r.event;
+      c->duration = r.duration;
+      c->nextTime = r.nextTime;
+
+      if (lastCell)   lastCell->link(c);
+      else            firstCell = c;
+      lastCell = c;
+      cellsRead += 1;
+
+      if (cellsRead == cellCount) {
+        // close the loop, and position just before the start
+        lastCell->link(firstCell);
+        loop.recentCell = lastCell;
+        loop.timeSinceRecent = lastCell->nextTime;
+        loop.firstCell = nullptr;
+        loop.armed = false;
+        loop.layerArmed = true;
+      }
+      startPhase(cells);
+      return;
+    }
+
+    default:
+      abandon();
+      return;
+  }
+}
+
+bool Loop::Reader::write(const uint8_t* buf, size_t len) {
+  size_t n = 0;
+  while (phase != invalid && phase != done && n < len) {
+    size_t k = std::min(len - n, stageLen - stagePos);
+    std::memcpy(stage + stagePos, buf + n, k);
+    n += k;
+    stagePos += k;
+    if (stagePos == stageLen)
+      unstage();
+  }
+
+  return phase != invalid;
+    // any data past the end of the image is ignored
+}
+
+bool Loop::Reader::finish() {
+  if (phase == done) {
+    loop.edits += 1;
+    loop.rebuildDensity();
+    return true;
+  }
+
+  if (phase != invalid)
+    abandon();
+  return false;
+}
+
+void Loop::Reader::abandon() {
+  bool started = phase != header;
+  startPhase(invalid);
+  if (!started)
+    return;   // the loop hasn't been touched
+
+  if (lastCell && cellsRead < cellCount) {
+    lastCell->link(firstCell);    // close them up so clear() frees them
+    loop.recentCell = lastCell;
+  }
+  firstCell = lastCell = nullptr;
+  loop.clear();
+}
+
+
+#if !defined(ARDUINO)
+
+bool writeLoopFile(const Loop& loop, const char* path) {
+  FILE* f = std::fopen(path, "wb");
+  if (!f) return false;
+
+  Loop::Writer w(loop);
+  uint8_t buf[256];
+  bool ok = true;
+  while (size_t n = w.read(buf, sizeof(buf)))
+    ok = ok && std::fwrite(buf, 1, n, f) == n;
+
+  return std::fclose(f) == 0 && ok;
+}
+
+bool readLoopFile(Loop& loop, const char* path) {
+  FILE* f = std::fopen(path, "rb");
+  if (!f) return false;
+
+  Loop::Reader r(loop);
+  uint8_t buf[256];
+  bool ok = true;
+  while (size_t n = std::fread(buf, 1, sizeof(buf), f))
+    ok = ok && r.write(buf, n);
+
+  std::fclose(f);
+  return r.finish() && ok;
+}
+
+#endif
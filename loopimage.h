@@ -0,0 +1,101 @@
+#ifndef _INCLUDE_LOOPIMAGE_H_
+#define _INCLUDE_LOOPIMAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "looper.h"
+
+
+/**
+***  Loop Images
+**/
+
+// A loop image is a compact, versioned binary form of the contents of a
+// Loop: a fixed header, a record for each stored scene, and one for the scene
+// playing, followed by one fixed size record per cell, in loop order starting
+// from the start cell. All values are little endian, which is
+// native for both the SAMD parts and the host.
+//
+// Both Writer and Reader work in chunks of any size, so an image can be
+// streamed to or from flash, serial, or a file without a buffer for all of it.
+
+namespace LoopImage {
+  const uint32_t magic = 0x4c594342;   // "BCYL"
+  const uint16_t version = 1;
+}
+
+
+class Loop::Writer {
+public:
+  Writer(const Loop&);
+
+  size_t read(uint8_t* buf, size_t len);
+    // fill buf with the next part of the image, returns 0 when done
+
+  bool stale() const { return loop.edits != edits; }
+    // the loop has changed since the image was started, start over
+
+  size_t size() const;    // total size of the image
+
+private:
+  const Loop& loop;
+  const uint16_t edits;
+
+  const Cell* startCell;
+  const Cell* nextCell;
+  uint16_t cellCount;
+  uint8_t scenesStaged;
+
+  bool stageNext();
+
+  uint8_t stage[20];
+  size_t stageLen;
+  size_t stagePos;
+};
+
+
+class Loop::Reader {
+public:
+  Reader(Loop&);
+
+  bool write(const uint8_t* buf, size_t len);
+    // consume the next part of the image, returns false if it is not valid
+
+  bool complete() const { return phase == done; }
+
+  bool finish();
+    // returns true if a whole image was read, and the loop is now playing it
+
+private:
+  Loop& loop;
+
+  enum Phase { header, scenes, cells, done, invalid };
+  Phase phase;
+
+  uint8_t sceneCount;
+  uint8_t scenesRead;
+  uint16_t cellCount;
+  uint16_t cellsRead;
+  Cell* firstCell;
+  Cell* lastCell;
+
+  void unstage();
+  void startPhase(Phase);
+  void abandon();
+
+  uint8_t stage[20];
+  size_t stageLen;
+  size_t stagePos;
+};
+
+
+#if !defined(ARDUINO)
+// host side versions for reading and writing images as files
+
+bool writeLoopFile(const Loop&, const char* path);
+bool readLoopFile(Loop&, const char* path);
+#endif
+
+
+#endif // _INCLUDE_LOOPIMAGE_H_
@@ -0,0 +1,302 @@
+#include "midiout.h"
+
+#include <algorithm>
+#include <array>
+
+#include <Arduino.h>
+#include <Adafruit_TinyUSB.h>
+#include <Adafruit_ZeroDMA.h>
+
+#include "config.h"
+#include "usbmidi.h"
+
+
+extern Adafruit_USBD_MIDI usb_midi;   // see bicycle.ino
+
+
+namespace {
+
+  std::array<uint8_t, config.layers> layerRoutes;
+  std::array<uint8_t, 16> channelRoutes;
+  uint8_t systemRoute;
+
+  std::array<MidiPortStats, portCount> stats;
+
+  void queued(MidiPort p, uint32_t n) {
+    MidiPortStats& s = stats[p];
+    s.queued = uint16_t(n);
+    s.mostQueued = std::max(s.mostQueued, s.queued);
+  }
+
+  void dropped(MidiPort p) {
+    MidiPortStats& s = stats[p];
+    if (s.dropped < 0xffff) s.dropped += 1;
+  }
+
+
+  // USB: packets wait here until the USB stack will take them.
+
+  const uint32_t usbCapacity = 64;    // must be a power of two
+  const uint32_t usbOffRoom = 16;
+    // packets only NoteOffs may use, so a full queue can't leave notes hung
+  uint8_t usbRing[usbCapacity][4];
+  uint32_t usbHead = 0;   // count of packets put in
+  uint32_t usbTail = 0;   // count of packets sent
+
+  void usbFlush() {
+    while (usbTail != usbHead && usb_midi.send(usbRing[usbTail % usbCapacity]))
+      usbTail += 1;
+    queued(portUsb, usbHead - usbTail);
+  }
+
+  void usbSend(const MidiEvent& ev) {
+    uint32_t room = ev.isNoteOff() ? usbCapacity : usbCapacity - usbOffRoom;
+    if (usbHead - usbTail >= room) {
+      dropped(portUsb);
+      return;
+    }
+    usbMidiEncode(ev, usbRing[usbHead % usbCapacity]);
+    usbHead += 1;
+    usbFlush();
+  }
+
+
+  // DIN: bytes wait here, and DMA takes them a run at a time, the DMA done
+  // callback starting the next run. Only whole messages go in, so a dropped
+  // message can't leave running status wrong.
+
+#if defined(__SAMD51__)
+  Sercom* const dinSercom = SERCOM5;    // Serial1, on the Feather M4
+  const uint8_t dinTrigger = SERCOM5_DMAC_ID_TX;
+#else
+  Sercom* const dinSercom = SERCOM0;    // Serial1, on the Feather M0
+  const uint8_t dinTrigger = SERCOM0_DMAC_ID_TX;
+#endif
+
+  const uint32_t dinCapacity = 256;   // must be a power of two
+  const uint32_t dinOffRoom = 48;     // bytes, likewise, 16 NoteOffs
+  uint8_t dinRing[dinCapacity];
+  volatile uint32_t dinHead = 0;      // count of bytes put in
+  volatile uint32_t dinTail = 0;      // count of bytes sent
+  volatile uint32_t dinSending = 0;   // bytes in the DMA run, 0 if idle
+  uint8_t dinRunning = 0;             // running status, 0 if none
+
+  Adafruit_ZeroDMA dinDma;
+  DmacDescriptor* dinDescriptor = nullptr;
+
+  void dinStart() {
+    // starts a DMA run of what's queued, if one isn't going already
+    // call with interrupts off, or from the DMA callback
+
+    if (dinSending || dinHead == dinTail) return;
+
+    uint32_t at = dinTail % dinCapacity;
+    uint32_t n = std::min<uint32_t>(dinHead - dinTail, dinCapacity - at);
+      // up to the end of the ring, the rest is the next run
+    dinDma.changeDescriptor(dinDescriptor, &dinRing[at], nullptr, n);
+    dinSending = n;
+    dinDma.startJob();
+  }
+
+  void dinDone(Adafruit_ZeroDMA*) {
+    dinTail += dinSending;
+    dinSending = 0;
+    dinStart();
+  }
+
+  bool dinQueue(const uint8_t* bytes, uint32_t n, uint32_t room) {
+    // queues all n bytes, or none if that would fill more than room
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (dinHead - dinTail + n > room) {
+      __set_PRIMASK(primask);
+      return false;
+    }
+
+    for (uint32_t i = 0; i < n; ++i)
+      dinRing[(dinHead + i) % dinCapacity] = bytes[i];
+    dinHead += n;
+    uint32_t depth = dinHead - dinTail;
+    dinStart();
+    __set_PRIMASK(primask);
+
+    queued(portDin, depth);
+    return true;
+  }
+
+  void dinSendNow(const MidiEvent& ev) {
+    uint8_t bytes[3] = { ev.status, ev.data1, ev.data2 };
+    uint32_t n = usbMidiLength(usbMidiCodeIndex(ev.status));
+    const uint8_t* from = bytes;
+
+    bool channelMessage = ev.status >= 0x80 && ev.status < 0xf0;
+    if (channelMessage && ev.status == dinRunning) {
+      from += 1;
+      n -= 1;
+    }
+
+    uint32_t room = ev.isNoteOff() ? dinCapacity : dinCapacity - dinOffRoom;
+    if (!dinQueue(from, n, room)) {
+      dropped(portDin);
+      return;
+    }
+
+    if (channelMessage)         dinRunning = ev.status;
+    else if (ev.status < 0xf8)  dinRunning = 0;
+      // system common cancels running status, realtime doesn't
+  }
+
+
+  // While a SysEx passed through is part way out on DIN, any status byte but
+  // realtime would end it, so what is played waits here until it is over.
+  // SysEx arrives over USB far faster than DIN sends it, so this is only for
+  // the packets between, a long dump still delays notes by as long as it
+  // takes to send.
+
+  bool dinInSysEx = false;
+  const size_t dinHeldCapacity = 16;
+  const size_t dinHeldOffRoom = 4;    // events, likewise
+  std::array<MidiEvent, dinHeldCapacity> dinHeld;
+  size_t dinHeldCount = 0;
+
+  void dinSend(const MidiEvent& ev) {
+    if (!dinInSysEx || ev.status >= 0xf8) {
+      dinSendNow(ev);
+      return;
+    }
+
+    size_t room = ev.isNoteOff() ? dinHeldCapacity
+      : dinHeldCapacity - dinHeldOffRoom;
+    if (dinHeldCount < room)
+      dinHeld[dinHeldCount++] = ev;
+    else
+      dropped(portDin);
+  }
+
+  void dinEndSysEx() {
+    dinInSysEx = false;
+    for (size_t i = 0; i < dinHeldCount; ++i)
+      dinSendNow(dinHeld[i]);
+    dinHeldCount = 0;
+  }
+
+  bool dinPassThrough(const uint8_t packet[4]) {
+    // as midiOutPassThrough(), for the MIDI bytes the packet carries
+    const uint8_t* bytes = packet + 1;
+    uint32_t n = usbMidiLength(packet[0] & 0x0f);
+    if (!dinQueue(bytes, n, dinCapacity - dinOffRoom))
+      return false;
+
+    bool ended = false;
+    for (uint32_t i = 0; i < n; ++i) {
+      uint8_t b = bytes[i];
+      if (b < 0xf0 || b >= 0xf8) continue;
+        // data, or realtime, which changes nothing
+      dinRunning = 0;
+      if (b == 0xf0) {
+        dinInSysEx = true;
+        ended = false;
+      }
+      else if (dinInSysEx) {
+        ended = true;     // 0xF7, or any system common, ends a SysEx
+      }
+    }
+    if (ended)
+      dinEndSysEx();
+    return true;
+  }
+
+  void dinBegin() {
+    Serial1.begin(31250);
+
+    dinDma.allocate();
+    dinDma.setTrigger(dinTrigger);
+    dinDma.setAction(DMA_TRIGGER_ACTON_BEAT);
+    dinDescriptor = dinDma.addDescriptor(dinRing,
+      const_cast<void*>(static_cast<volatile void*>(&dinSercom->USART.DATA.reg)),
+      1, DMA_BEAT_SIZE_BYTE, true, false);
+    dinDma.setCallback(dinDone);
+  }
+}
+
+
+void midiOutBegin() {
+  layerRoutes.fill(routeBoth);
+  channelRoutes.fill(routeBoth);
+  systemRoute = routeBoth;
+  stats.fill({ 0, 0, 0 });
+
+  if (config.dinMidi)
+    dinBegin();
+}
+
+void midiOutUpdate() {
+  if (usbTail != usbHead)
+    usbFlush();
+
+  if (config.dinMidi)
+    queued(portDin, dinHead - dinTail);
+}
+
+void midiOutSend(const MidiEvent& ev, uint8_t layer) {
+  uint8_t route = ev.status < 0xf0
+    ? channelRoutes[ev.status & 0x0f] : systemRoute;
+  if (layer < config.layers)
+    route &= layerRoutes[layer];
+
+  if (route & routeUsb)
+    usbSend(ev);
+  if ((route & routeDin) && config.dinMidi)
+    dinSend(ev);
+}
+
+bool midiOutPassThrough(const uint8_t packet[4]) {
+  bool toUsb = systemRoute & routeUsb;
+  bool toDin = (systemRoute & routeDin) && config.dinMidi;
+  if (usbMidiIsSysEx(packet) && packet[1] != 0xf0 && !dinInSysEx)
+    toDin = false;
+    // the rest of a SysEx that started before DIN was routed to
+
+  if (toUsb && usbHead - usbTail >= usbCapacity - usbOffRoom)
+    return false;
+  if (toDin && !dinPassThrough(packet))
+    return false;
+    // the USB queue only empties, so once checked it can be queued after
+
+  if (toUsb) {
+    uint8_t* p = usbRing[usbHead % usbCapacity];
+    p[0] = packet[0] & 0x0f;    // always sent out on cable 0
+    p[1] = packet[1];
+    p[2] = packet[2];
+    p[3] = packet[3];
+    usbHead += 1;
+    usbFlush();
+  }
+  return true;
+}
+
+void midiRouteLayer(uint8_t layer, MidiRoute r) {
+  if (layer < config.layers) layerRoutes[layer] = r;
+}
+
+void midiRouteChannel(uint8_t channel, MidiRoute r) {
+  if (channel < 16) channelRoutes[channel] = r;
+}
+
+void midiRouteSystem(MidiRoute r) {
+  systemRoute = r;
+
+  if (config.dinMidi && !(r & routeDin) && dinInSysEx) {
+    const uint8_t end = 0xf7;
+    dinQueue(&end, 1, dinCapacity);
+    dinRunning = 0;
+    dinEndSysEx();
+  }
+    // a SysEx cut off on DIN is ended there, or what's played would wait
+    // for an end that never came
+}
+
+MidiPortStats midiOutStats(MidiPort p) {
+  return stats[p];
+}
@@ -0,0 +1,66 @@
+#ifndef _INCLUDE_MIDIOUT_H_
+#define _INCLUDE_MIDIOUT_H_
+
+#include <cstdint>
+
+#include "types.h"
+
+
+/**
+***  MIDI Output Ports
+**/
+
+// What is played goes out over USB, over DIN from Serial1, or both, routed by
+// the layer it was recorded on, and by its channel: a port gets an event only
+// if both route it there. What passes through from the input, clock, SysEx,
+// and the like, goes by a route of its own, to both to start with.
+//
+// Sending only ever queues. USB packets are moved out from midiOutUpdate(),
+// and DIN bytes by DMA, so neither port can hold up the loop. When a port's
+// queue is full, the event is dropped from that port, and counted. The last
+// of each queue is kept for NoteOffs, so it is the notes that would be
+// started that are dropped, not the ends of those already sounding. DIN uses
+// running status, and needs config.dinMidi, see config.h. While a SysEx is
+// going out on DIN, what is played waits for it to end.
+
+enum MidiPort : uint8_t {
+  portUsb,
+  portDin,
+
+  portCount
+};
+
+enum MidiRoute : uint8_t {
+  routeUsb = 1 << portUsb,
+  routeDin = 1 << portDin,
+  routeBoth = routeUsb | routeDin,
+};
+
+struct MidiPortStats {
+  uint16_t  queued;       // packets for USB, bytes for DIN
+  uint16_t  mostQueued;
+  uint16_t  dropped;      // events
+};
+
+
+void midiOutBegin();
+void midiOutUpdate();
+  // call from loop(), moves out what USB will take
+
+void midiOutSend(const MidiEvent&, uint8_t layer);
+  // layer is as from Loop::layer(), layers out of range go by channel alone
+
+bool midiOutPassThrough(const uint8_t packet[4]);
+  // a USB-MIDI packet of SysEx, system common, or realtime from the input,
+  // queued in order with what is played: returns false, and queues nothing,
+  // if there isn't room yet, so it can be held, and tried again
+
+void midiRouteLayer(uint8_t layer, MidiRoute);
+void midiRouteChannel(uint8_t channel, MidiRoute);
+void midiRouteSystem(MidiRoute);
+  // for pass through, and anything played that isn't a channel message
+
+MidiPortStats midiOutStats(MidiPort);
+
+
+#endif // _INCLUDE_MIDIOUT_H_
@@ -0,0 +1,107 @@
+#ifndef _INCLUDE_NOTETABLE_H_
+#define _INCLUDE_NOTETABLE_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "cell.h"
+
+
+// A small open addressed hash table of entries for notes, keyed by channel and
+// note number. Each entry refers to a cell, and the key is taken from that
+// cell's event, so entries cost no more than the cell pointer and whatever
+// else they hold. An entry with no cell is empty.
+//
+// N must be a power of two, and should be about twice the number of notes
+// expected to be tracked at once. Removal shifts entries back rather than
+// leaving tombstones, so lookups stay short however long the table is used.
+
+template< typename Entry, size_t N >
+class NoteTable {
+public:
+  NoteTable() { clear(); }
+
+  Entry* find(uint8_t channel, uint8_t note) {
+    for (size_t i = home(channel, note), n = 0; n < N; i = next(i), ++n) {
+      Entry& e = entries[i];
+      if (!e.cell)                    return nullptr;
+      if (matches(e, channel, note))  return &e;
+    }
+    return nullptr;
+  }
+
+  Entry* insert(uint8_t channel, uint8_t note) {
+    // returns the existing entry, or a new empty one to be filled in
+    // returns nullptr if the table is full
+
+    if (count >= maxCount)
+      return find(channel, note);
+
+    for (size_t i = home(channel, note);; i = next(i)) {
+      Entry& e = entries[i];
+      if (!e.cell) {
+        count += 1;
+        return &e;
+      }
+      if (matches(e, channel, note))
+        return &e;
+    }
+  }
+
+  void remove(Entry* e) {
+    size_t i = e - &entries[0];
+    entries[i].cell = nullptr;
+    count -= 1;
+
+    // shift back any entries that would no longer be found
+    for (size_t j = next(i); entries[j].cell; j = next(j)) {
+      size_t h = home(entries[j].cell->event);
+      if (((j - h) & mask) >= ((j - i) & mask)) {
+        entries[i] = entries[j];
+        entries[j].cell = nullptr;
+        i = j;
+      }
+    }
+  }
+
+  void clear() {
+    for (auto& e : entries) e.cell = nullptr;
+    count = 0;
+  }
+
+  template< typename Rank >
+  Entry* most(Rank rank) {
+    // the entry that ranks highest, or nullptr if there are none
+    // looks at every slot, so is for when the table is full, not every note
+
+    Entry* m = nullptr;
+    for (auto& e : entries)
+      if (e.cell && (!m || rank(e) > rank(*m)))
+        m = &e;
+    return m;
+  }
+
+private:
+  static const size_t mask = N - 1;
+  static const size_t maxCount = N * 3 / 4;
+  static_assert((N & mask) == 0, "NoteTable size must be a power of two");
+
+  std::array<Entry, N> entries;
+  size_t count;
+
+  static size_t next(size_t i) { return (i + 1) & mask; }
+
+  static size_t home(uint8_t channel, uint8_t note)
+    { return (note ^ (channel * 37u)) & mask; }
+  static size_t home(const MidiEvent& ev)
+    { return home(ev.status & 0x0f, ev.data1); }
+
+  static bool matches(const Entry& e, uint8_t channel, uint8_t note) {
+    return e.cell->event.data1 == note
+      && (e.cell->event.status & 0x0f) == channel;
+  }
+};
+
+
+#endif // _INCLUDE_NOTETABLE_H_
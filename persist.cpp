@@ -0,0 +1,418 @@
+#include "persist.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include <Arduino.h>
+#include <Adafruit_SPIFlash.h>
+
+#include "eventlog.h"
+#include "loopimage.h"
+
+
+/**
+***  Loop Persistence
+**/
+
+// Loop images are kept in the last 128k of the board's QSPI (or SPI) flash,
+// in two slots of 64k, and small blocks of settings in the sectors just below.
+// Note: if the flash holds a file system, it mustn't reach into this area.
+//
+// Saving is done a step at a time from persistUpdate(): each step issues one
+// sector erase or page program, and returns at once if the flash is still
+// busy with the previous one, so it never stalls the loop. The page holding
+// the header is written last, so a save cut short by power loss leaves no
+// valid image, rather than a damaged one.
+//
+// Each save goes to the slot not holding the newest image, so that image
+// stays good until the new one is complete. The slot is erased first, and
+// then the save waits for the loop to go unchanged for a while before
+// writing it, as an image is only good if the loop doesn't change while it
+// is written. If it does anyway, the save starts over, but only a few times,
+// as each time costs an erase of the slot.
+
+#if defined(EXTERNAL_FLASH_USE_QSPI) || defined(EXTERNAL_FLASH_USE_SPI)
+
+namespace {
+
+#if defined(EXTERNAL_FLASH_USE_QSPI)
+  Adafruit_FlashTransport_QSPI flashTransport;
+#else
+  Adafruit_FlashTransport_SPI flashTransport(
+    EXTERNAL_FLASH_USE_CS, EXTERNAL_FLASH_USE_SPI);
+#endif
+  Adafruit_SPIFlash flash(&flashTransport);
+
+  bool flashReady = false;
+
+  const uint32_t sectorSize = 4096;
+  const uint32_t pageSize = 256;
+
+  // Each image slot starts with a tag, so the newest can be found.
+  const uint32_t slotMagic = 0x53594342;    // "BCYS"
+
+  struct SlotTag {
+    uint32_t magic;
+    uint32_t sequence;    // one more than the save before
+  };
+
+  const uint8_t imageSlots = 2;
+  const uint32_t slotSize = 64 * 1024;
+  const uint32_t regionSize = imageSlots * slotSize;
+  static_assert(sizeof(SlotTag) + 16 + (Loop::sceneCount + 1) * 20
+      + config.cells * 8 <= slotSize,
+    "an image of a loop using every cell must fit, see loopimage.cpp");
+
+  uint32_t regionStart() { return flash.size() - regionSize; }
+  uint32_t slotStart(uint8_t slot) { return regionStart() + slot * slotSize; }
+
+  uint8_t newestSlot = 0;
+  uint32_t newestSequence = 0;    // 0 if there's no image in either slot
+
+  bool flashBusy() {
+    uint8_t st;
+    flashTransport.readCommand(SFLASH_CMD_READ_STATUS, &st, 1);
+    return st & 0x01;
+  }
+
+  void flashErase(uint32_t addr) {
+    flashTransport.runCommand(SFLASH_CMD_WRITE_ENABLE);
+    flashTransport.eraseCommand(SFLASH_CMD_ERASE_SECTOR, addr);
+  }
+
+  void flashProgram(uint32_t addr, const uint8_t* buf, uint32_t len) {
+    flashTransport.runCommand(SFLASH_CMD_WRITE_ENABLE);
+    flashTransport.writeMemory(addr, buf, len);
+  }
+
+
+  // Blocks, for settings, each get a sector of their own, below the loop.
+  const uint8_t blockSlots = 8;
+  const uint32_t blockMagic = 0x42594342;   // "BCYB"
+
+  struct BlockHeader {
+    uint32_t magic;
+    uint16_t length;
+    uint16_t check;     // ~length
+  };
+
+  uint32_t blockStart(uint8_t slot)
+    { return regionStart() - (slot + 1) * sectorSize; }
+
+
+  enum SaveState { idle, erasing, waiting, writing, finishing };
+  SaveState state = idle;
+
+  // what is being saved
+  enum SaveSource { sourceLoop, sourceBlock };
+  SaveSource source;
+
+  const Loop* saveLoop = nullptr;
+  bool loopPending = false;
+  alignas(Loop::Writer) uint8_t writerSpace[sizeof(Loop::Writer)];
+  Loop::Writer* writer = nullptr;
+
+  uint8_t saveSlot;
+  bool slotErased = false;    // saveSlot is erased, and nothing written yet
+
+  const unsigned long quietTime = 500;    // ms the loop must go unchanged
+  uint16_t quietEdits;
+  unsigned long quietSince;
+
+  const uint8_t saveTries = 4;
+  uint8_t tries;              // starts of writing, for this save
+
+  const uint8_t* saveBlock = nullptr;
+  uint16_t saveBlockLen;
+  uint8_t saveBlockSlot;
+
+  struct PendingBlock {
+    const uint8_t* data;
+    uint16_t len;
+  };
+  PendingBlock pendingBlocks[blockSlots];
+  uint8_t blocksPending = 0;    // bit per slot
+  uint32_t blockPos;
+
+  uint32_t sourceSize() {
+    return source == sourceLoop
+      ? writer->size() : sizeof(BlockHeader) + saveBlockLen;
+  }
+
+  bool sourceStale() {
+    return source == sourceLoop && writer && writer->stale();
+  }
+
+  uint32_t sourceRead(uint8_t* buf, uint32_t len) {
+    if (source == sourceLoop)
+      return writer->read(buf, len);
+
+    BlockHeader h = { blockMagic, saveBlockLen, uint16_t(~saveBlockLen) };
+    uint32_t n = 0;
+    while (n < len && blockPos < sizeof(h) + saveBlockLen) {
+      buf[n++] = blockPos < sizeof(h)
+        ? reinterpret_cast<const uint8_t*>(&h)[blockPos]
+        : saveBlock[blockPos - sizeof(h)];
+      blockPos += 1;
+    }
+    return n;
+  }
+
+  uint32_t saveStart;
+  uint32_t eraseEnd;
+  uint32_t nextAddr;
+
+  uint8_t headerPage[pageSize];
+  uint32_t headerLen;
+  uint8_t page[pageSize];
+
+  void endSave() {
+    if (writer) writer->~Writer();
+    writer = nullptr;
+    state = idle;
+  }
+
+  void startSave() {
+    // blocks are small, so they go first
+    endSave();
+
+    if (blocksPending) {
+      saveBlockSlot = 0;
+      while (!(blocksPending & (1 << saveBlockSlot)))
+        saveBlockSlot += 1;
+      blocksPending &= ~(1 << saveBlockSlot);
+      saveBlock = pendingBlocks[saveBlockSlot].data;
+      saveBlockLen = pendingBlocks[saveBlockSlot].len;
+      source = sourceBlock;
+      blockPos = 0;
+      saveStart = blockStart(saveBlockSlot);
+      eraseEnd = saveStart + sectorSize;
+    } else if (loopPending) {
+      loopPending = false;
+      source = sourceLoop;
+      saveSlot = newestSequence ? 1 - newestSlot : 0;
+      saveStart = slotStart(saveSlot);
+      eraseEnd = saveStart + slotSize;
+        // the whole slot, as the loop may grow before it is written
+      if (slotErased) {
+        nextAddr = eraseEnd;
+        state = waiting;
+        return;
+      }
+    } else {
+      return;
+    }
+
+    nextAddr = saveStart;
+    state = erasing;
+  }
+
+  void startWriting() {
+    // the header page is held back to be written last
+    headerLen = 0;
+    if (source == sourceLoop) {
+      writer = new (writerSpace) Loop::Writer(*saveLoop);
+      SlotTag tag = { slotMagic, newestSequence + 1 };
+      std::memcpy(headerPage, &tag, sizeof(tag));
+      headerLen = sizeof(tag);
+      slotErased = false;
+      tries += 1;
+    }
+    headerLen += sourceRead(headerPage + headerLen, pageSize - headerLen);
+    nextAddr = saveStart + pageSize;
+    state = writing;
+  }
+
+  bool readTag(uint8_t slot, uint32_t& sequence) {
+    SlotTag tag;
+    flash.readBuffer(slotStart(slot), reinterpret_cast<uint8_t*>(&tag),
+      sizeof(tag));
+    sequence = tag.sequence;
+    return tag.magic == slotMagic && tag.sequence != 0;
+  }
+
+  bool restoreSlot(Loop& loop, uint8_t slot) {
+    Loop::Reader r(loop);
+    uint8_t buf[64];
+    uint32_t end = slotStart(slot) + slotSize;
+    for (uint32_t addr = slotStart(slot) + sizeof(SlotTag);
+        !r.complete() && addr < end;
+        addr += sizeof(buf)) {
+      flash.readBuffer(addr, buf, std::min<uint32_t>(sizeof(buf), end - addr));
+      if (!r.write(buf, std::min<uint32_t>(sizeof(buf), end - addr)))
+        break;
+    }
+    return r.finish();
+  }
+}
+
+
+void persistBegin() {
+  flashReady = flash.begin();
+}
+
+bool persistRestore(Loop& loop) {
+  if (!flashReady) return false;
+
+  uint32_t seq[imageSlots];
+  bool tagged[imageSlots];
+  for (uint8_t i = 0; i < imageSlots; ++i)
+    tagged[i] = readTag(i, seq[i]);
+
+  uint8_t first = 0;
+  if (tagged[0] && tagged[1])   first = int32_t(seq[1] - seq[0]) > 0 ? 1 : 0;
+  else if (tagged[1])           first = 1;
+
+  // newest first, and if that image is bad, the one before it
+  for (uint8_t k = 0; k < imageSlots; ++k) {
+    uint8_t i = (first + k) % imageSlots;
+    if (tagged[i] && restoreSlot(loop, i)) {
+      newestSlot = i;
+      newestSequence = seq[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+void persistSave(const Loop& loop) {
+  if (!flashReady) return;
+
+  saveLoop = &loop;
+  tries = 0;
+  if (state != idle && source == sourceLoop
+      && (state == erasing || state == waiting))
+    return;
+    // it hasn't been written yet, so it will have what the loop has then
+
+  loopPending = true;
+  if (state == idle)
+    startSave();
+    // otherwise, once what is being written is done
+}
+
+bool persistRestoreBlock(uint8_t slot, void* data, uint16_t len) {
+  if (!flashReady || slot >= blockSlots) return false;
+
+  BlockHeader h;
+  flash.readBuffer(blockStart(slot), reinterpret_cast<uint8_t*>(&h), sizeof(h));
+  if (h.magic != blockMagic || h.length != len || h.check != uint16_t(~len))
+    return false;
+
+  flash.readBuffer(blockStart(slot) + sizeof(h),
+    static_cast<uint8_t*>(data), len);
+  return true;
+}
+
+void persistSaveBlock(uint8_t slot, const void* data, uint16_t len) {
+  if (!flashReady || slot >= blockSlots
+      || sizeof(BlockHeader) + len > sectorSize)
+    return;
+
+  pendingBlocks[slot] = { static_cast<const uint8_t*>(data), len };
+  blocksPending |= 1 << slot;
+    // each slot waits on its own, a second save to the same slot replaces
+    // the first, which hasn't been started
+  if (state == idle)
+    startSave();
+}
+
+void persistUpdate(unsigned long now) {
+  if (state == idle || flashBusy()) return;
+
+  if (sourceStale()) {
+    // the loop changed under us, the slot is erased again, and the save
+    // waits for the loop to settle
+    if (tries < saveTries) {
+      loopPending = true;
+    } else {
+      logMessage("save: gave up, the loop kept changing");
+    }
+    startSave();
+    return;
+  }
+
+  switch (state) {
+    case erasing:
+      if (nextAddr < eraseEnd) {
+        flashErase(nextAddr);
+        nextAddr += sectorSize;
+        break;
+      }
+      if (source == sourceLoop) {
+        slotErased = true;
+        quietEdits = saveLoop->editCount();
+        quietSince = now;
+        state = waiting;
+        break;
+      }
+      startWriting();
+      break;
+
+    case waiting:
+      if (blocksPending) {
+        // settings don't wait on the loop
+        loopPending = true;
+        startSave();
+        break;
+      }
+      if (saveLoop->editCount() != quietEdits) {
+        quietEdits = saveLoop->editCount();
+        quietSince = now;
+        break;
+      }
+      if (now - quietSince >= quietTime)
+        startWriting();
+      break;
+
+    case writing: {
+      uint32_t n = sourceRead(page, pageSize);
+      if (n) {
+        flashProgram(nextAddr, page, n);
+        nextAddr += pageSize;
+        break;
+      }
+      state = finishing;
+      break;
+    }
+
+    case finishing:
+      flashProgram(saveStart, headerPage, headerLen);
+      if (source == sourceLoop) {
+        newestSlot = saveSlot;
+        newestSequence += 1;
+      }
+      endSave();
+      startSave();    // anything that was waiting
+      break;
+
+    default:
+      state = idle;
+      break;
+  }
+}
+
+bool persistSaving() {
+  return state != idle;
+}
+
+bool persistSavingBlock() {
+  return blocksPending || (state != idle && source == sourceBlock);
+}
+
+
+#else
+
+// no flash on this board
+
+void persistBegin() { }
+bool persistRestore(Loop&) { return false; }
+void persistSave(const Loop&) { }
+bool persistRestoreBlock(uint8_t, void*, uint16_t) { return false; }
+void persistSaveBlock(uint8_t, const void*, uint16_t) { }
+void persistUpdate(unsigned long) { }
+bool persistSaving() { return false; }
+bool persistSavingBlock() { return false; }
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _INCLUDE_PERSIST_H_
+#define _INCLUDE_PERSIST_H_
+
+#include <cstdint>
+
+#include "looper.h"
+
+
+void persistBegin();
+bool persistRestore(Loop&);   // at boot, returns true if a loop was restored
+
+void persistSave(const Loop&);
+  // save the loop in the background, once it has been left unchanged for a
+  // moment, the image saved before stays good until this one is complete
+void persistUpdate(unsigned long);
+  // call from loop(), does a bounded amount of the save each time
+
+bool persistRestoreBlock(uint8_t slot, void* data, uint16_t len);
+  // returns true if a block of exactly len bytes was saved in slot (0 ~ 7)
+void persistSaveBlock(uint8_t slot, const void* data, uint16_t len);
+  // save a block of settings in the background, at most 4k
+  // data is written from where it is, so it must stay put, and unchanged,
+  // until persistSavingBlock() is false
+
+bool persistSaving();
+bool persistSavingBlock();
+  // a block is waiting to be saved, or being saved
+
+
+#endif // _INCLUDE_PERSIST_H_
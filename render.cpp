@@ -0,0 +1,98 @@
+#include "render.h"
+
+#if !defined(ARDUINO)
+
+#include <cstring>
+
+#include "looper.h"
+
+
+namespace {
+  FILE* renderOut = nullptr;
+  Loop* renderLoop = nullptr;
+
+  void renderEvent(const MidiEvent& ev) {
+    std::fprintf(renderOut, "%lu %02x %02x %02x\n",
+      static_cast<unsigned long>(renderLoop->time()),
+      ev.status, ev.data1, ev.data2);
+  }
+}
+
+
+bool renderTrace(FILE* trace, FILE* out) {
+  Loop::begin();
+  Loop loop(renderEvent);
+
+  renderOut = out;
+  renderLoop = &loop;
+
+  char line[128];
+  unsigned long lineNumber = 0;
+  bool ok = true;
+
+  while (std::fgets(line, sizeof(line), trace)) {
+    lineNumber += 1;
+
+    unsigned long t;
+    char cmd[16];
+    unsigned a = 0, b = 0, c = 0;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    int n = std::sscanf(line, "%lu %15s %x %x %x", &t, cmd, &a, &b, &c);
+    if (n < 2) {
+      ok = false;
+      break;
+    }
+
+    loop.advance(t);
+
+    if      (!std::strcmp(cmd, "ev") && n == 5)
+      loop.addEvent({ uint8_t(a), uint8_t(b), uint8_t(c) });
+    else if (!std::strcmp(cmd, "keep"))           loop.keep();
+    else if (!std::strcmp(cmd, "arm"))            loop.arm();
+    else if (!std::strcmp(cmd, "clear"))          loop.clear();
+    else if (!std::strcmp(cmd, "mute") && n == 4) loop.layerMute(a, b != 0);
+    else if (!std::strcmp(cmd, "volume") && n == 4)
+      loop.layerVolume(a, b);
+    else if (!std::strcmp(cmd, "layer") && n == 3)
+      loop.layerArm(a);
+    else if (!std::strcmp(cmd, "overdub") && n == 3)
+      loop.overdub(a != 0);
+    else if (!std::strcmp(cmd, "autolength") && n == 3)
+      loop.autoLength(a != 0);
+    else if (!std::strcmp(cmd, "end"))
+      break;
+    else {
+      ok = false;
+      break;
+    }
+  }
+
+  if (!ok)
+    std::fprintf(stderr, "trace line %lu not understood: %s", lineNumber, line);
+
+  loop.clear();
+  renderLoop = nullptr;
+  renderOut = nullptr;
+  return ok;
+}
+
+
+#if defined(BICYCLE_RENDER_MAIN)
+
+int main(int argc, char* argv[]) {
+  FILE* in = argc > 1 ? std::fopen(argv[1], "r") : stdin;
+  FILE* out = argc > 2 ? std::fopen(argv[2], "w") : stdout;
+  if (!in || !out) {
+    std::fprintf(stderr, "usage: %s [trace [output]]\n", argv[0]);
+    return 2;
+  }
+
+  bool ok = renderTrace(in, out);
+  std::fclose(out);
+  return ok ? 0 : 1;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _INCLUDE_RENDER_H_
+#define _INCLUDE_RENDER_H_
+
+#if !defined(ARDUINO)
+
+#include <cstdio>
+
+
+// Offline rendering, on the host: drives a Loop from a timestamped trace of
+// input, with a virtual clock, as fast as it can, writing what the loop plays.
+//
+// Trace lines are a time in milliseconds, then a command:
+//    <ms> ev <status> <data1> <data2>    MIDI event, bytes in hex
+//    <ms> keep | arm | clear
+//    <ms> mute <layer> <0|1>
+//    <ms> volume <layer> <volume>
+//    <ms> layer <layer>                  layerArm()
+//    <ms> overdub <0|1>
+//    <ms> autolength <0|1>
+//    <ms> end                            render up to here and stop
+// Blank lines, and lines starting with #, are ignored.
+//
+// Output lines are:
+//    <ms> <status> <data1> <data2>       bytes in hex
+//
+// Build with:  g++ -O2 -DBICYCLE_RENDER_MAIN beatfit.cpp cell.cpp looper.cpp render.cpp
+
+bool renderTrace(FILE* trace, FILE* out);
+  // returns false if the trace has a line it can't understand
+
+#endif
+
+#endif // _INCLUDE_RENDER_H_
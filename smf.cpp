@@ -0,0 +1,687 @@
+#include "smf.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "cell.h"
+
+#if !defined(ARDUINO)
+#include <cstdio>
+#endif
+
+
+namespace {
+  const uint16_t ticksPerQuarter = 1000;
+  const uint32_t usPerQuarter = 1000000;    // so a tick is a millisecond
+  const uint32_t defaultTempo = 500000;     // what files assume if not set
+
+  const size_t maxLayers = 16;
+
+  inline uint8_t dataLength(uint8_t status) {
+    switch (status & 0xf0) {
+      case 0xc0:  // Program change
+      case 0xd0:  // Channel Aftertouch
+        return 1;
+      default:
+        return 2;
+    }
+  }
+
+  inline DeltaTime noteDuration(AbsTime t) {
+    // never 0, which the loop takes as a note with no NoteOff
+    return static_cast<DeltaTime>(
+      std::max<AbsTime>(1, std::min<AbsTime>(t, 0xffff)));
+  }
+
+  size_t varLenSize(uint32_t v) {
+    size_t n = 1;
+    while (v >>= 7) n += 1;
+    return n;
+  }
+
+  size_t putVarLen(uint8_t* p, uint32_t v, size_t n) {
+    // in n bytes, if more than needed, the first are 0x80, which adds nothing
+    for (size_t i = n; i > 0; --i) {
+      p[i - 1] = (v & 0x7f) | (i < n ? 0x80 : 0);
+      v >>= 7;
+    }
+    return n;
+  }
+
+  size_t putVarLen(uint8_t* p, uint32_t v) {
+    return putVarLen(p, v, varLenSize(v));
+  }
+
+  size_t put32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+    return 4;
+  }
+
+  size_t put16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8; p[1] = v;
+    return 2;
+  }
+
+  inline uint32_t get32(const uint8_t* p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16
+      | uint32_t(p[2]) << 8 | p[3];
+  }
+
+  inline uint16_t get16(const uint8_t* p) {
+    return uint16_t(p[0]) << 8 | p[1];
+  }
+
+  const size_t tempoEventSize = 1 + 3 + 3;    // delta, FF 51 03, tempo
+  const size_t endEventSize = 3;              // FF 2F 00, plus delta
+
+  const char cutShortText[] = "export cut short ";
+  const size_t cutShortLength = sizeof(cutShortText) - 1;
+}
+
+
+Loop::SmfWriter::SmfWriter(const Loop& l)
+  : loop(l), edits(l.edits), startCell(l.loopStart()),
+    phase(fileHeader), aborted(false),
+    trackCount(1 + std::min<size_t>(l.layerCount, maxLayers)), trackIndex(0),
+    trackLeft(0), textLeft(0), textSent(0),
+    stageLen(0), stagePos(0)
+  { }
+
+void Loop::SmfWriter::abort() {
+  if (phase != done)
+    aborted = true;
+    // takes effect at the next stage, what is staged is sent as it is
+}
+
+void Loop::SmfWriter::startTrack(Track& t, uint8_t layer) const {
+  t.layer = layer;
+  t.cell = startCell;
+  t.cellTime = 0;
+  t.lastTime = 0;
+  t.offCount = 0;
+}
+
+bool Loop::SmfWriter::nextEvent(Track& t, AbsTime& time, MidiEvent& ev) const {
+  while (t.cell && t.cell->layer != t.layer) {
+    t.cellTime += t.cell->nextTime;
+    t.cell = t.cell->next();
+    if (t.cell == startCell) t.cell = nullptr;
+  }
+
+  int e = -1;
+  for (int i = 0; i < t.offCount; ++i)
+    if (e < 0 || t.offs[i].time < t.offs[e].time)
+      e = i;
+
+  if (e >= 0
+      && (!t.cell || t.offs[e].time <= t.cellTime
+          || t.offCount == t.offs.size())) {
+    // an off is due, or there is no room to track another
+    // note: in the later case, the note is cut short
+    time = t.cell ? std::min(t.offs[e].time, t.cellTime) : t.offs[e].time;
+    ev = { t.offs[e].status, t.offs[e].note, 0 };
+    t.offs[e] = t.offs[--t.offCount];
+    t.lastTime = time;
+    return true;
+  }
+
+  if (!t.cell)
+    return false;
+
+  time = t.cellTime;
+  ev = t.cell->event;
+  if (ev.isNoteOn() && t.cell->duration > 0) {
+    t.offs[t.offCount++] = {
+      time + t.cell->duration,
+      static_cast<uint8_t>(0x80 | (ev.status & 0x0f)),
+      ev.data1 };
+  }
+
+  t.cellTime += t.cell->nextTime;
+  t.cell = t.cell->next();
+  if (t.cell == startCell) t.cell = nullptr;
+
+  t.lastTime = time;
+  return true;
+}
+
+uint32_t Loop::SmfWriter::trackSize(uint8_t layer) const {
+  Track t;
+  startTrack(t, layer);
+
+  uint32_t size = 0;
+  AbsTime time;
+  MidiEvent ev;
+  AbsTime last = 0;
+  while (nextEvent(t, time, ev)) {
+    size += varLenSize(time - last) + 1 + dataLength(ev.status);
+    last = time;
+  }
+  return size + 1 + endEventSize;
+}
+
+bool Loop::SmfWriter::stageNext() {
+  uint8_t* p = stage;
+
+  if (aborted) {
+    switch (phase) {
+      case trackHeader:   phase = abortChunk;   break;
+      case tempoEvent:
+      case trackEvents:   phase = abortTrack;   break;
+      default:                                  break;
+    }
+  }
+
+  switch (phase) {
+    case fileHeader:
+      std::memcpy(p, "MThd", 4);              p += 4;
+      p += put32(p, 6);
+      p += put16(p, 1);                       // format
+      p += put16(p, trackCount);
+      p += put16(p, ticksPerQuarter);
+      phase = trackHeader;
+      break;
+
+    case trackHeader: {
+      uint32_t size;
+      if (trackIndex == 0) {
+        AbsTime length = startCell ? loop.length : 0;
+        size = tempoEventSize + varLenSize(length) + endEventSize;
+      } else {
+        size = trackSize(trackIndex - 1);
+        startTrack(track, trackIndex - 1);
+      }
+      std::memcpy(p, "MTrk", 4);              p += 4;
+      p += put32(p, size);
+      trackLeft = size;
+      phase = trackIndex == 0 ? tempoEvent : trackEvents;
+      break;
+    }
+
+    case tempoEvent:
+      // the only event on the conductor track
+      *p++ = 0;
+      *p++ = 0xff; *p++ = 0x51; *p++ = 0x03;
+      *p++ = uint8_t(usPerQuarter >> 16);
+      *p++ = uint8_t(usPerQuarter >> 8);
+      *p++ = uint8_t(usPerQuarter);
+      trackLeft -= p - stage;
+      phase = trackEvents;
+      break;
+
+    case trackEvents: {
+      AbsTime last = track.lastTime;
+      AbsTime time;
+      MidiEvent ev;
+
+      if (trackIndex == 0) {
+        p += putVarLen(p, startCell ? loop.length : 0);
+      }
+      else if (nextEvent(track, time, ev)) {
+        p += putVarLen(p, time - last);
+        *p++ = ev.status;
+        *p++ = ev.data1;
+        if (dataLength(ev.status) > 1)
+          *p++ = ev.data2;
+        trackLeft -= p - stage;
+        break;
+      }
+      else {
+        *p++ = 0;
+      }
+
+      *p++ = 0xff; *p++ = 0x2f; *p++ = 0x00;
+      trackIndex += 1;
+      phase = trackIndex < trackCount ? trackHeader : done;
+      break;
+    }
+
+    case abortTrack: {
+      // the rest of the track, as a text event, and the end of the track:
+      // at least the end is still to come, so there are 4 bytes or more
+      uint32_t fill = trackLeft - 1 - endEventSize;
+      if (fill < 4) {
+        p += putVarLen(p, 0, fill + 1);   // too little for text, pad the delta
+        *p++ = 0xff; *p++ = 0x2f; *p++ = 0x00;
+        trackIndex += 1;
+        phase = abortChunk;
+        break;
+      }
+      size_t k = 1;
+      while (k < 4 && fill - 3 - k >= (uint32_t(1) << (7 * k)))
+        k += 1;
+      textLeft = fill - 3 - k;
+      textSent = 0;
+      *p++ = 0;
+      *p++ = 0xff; *p++ = 0x01;
+      p += putVarLen(p, textLeft, k);
+      phase = abortText;
+      break;
+    }
+
+    case abortText:
+      if (textLeft == 0) {
+        *p++ = 0;
+        *p++ = 0xff; *p++ = 0x2f; *p++ = 0x00;
+        trackIndex += 1;
+        phase = abortChunk;
+        break;
+      }
+      while (textLeft > 0 && p < stage + sizeof(stage)) {
+        *p++ = cutShortText[textSent++ % cutShortLength];
+        textLeft -= 1;
+      }
+      break;
+
+    case abortChunk:
+      std::memcpy(p, "BCYA", 4);              p += 4;
+      p += put32(p, 0);
+      phase = trackIndex < trackCount ? emptyTrack : done;
+      break;
+
+    case emptyTrack:
+      std::memcpy(p, "MTrk", 4);              p += 4;
+      p += put32(p, 1 + endEventSize);
+      *p++ = 0;
+      *p++ = 0xff; *p++ = 0x2f; *p++ = 0x00;
+      trackIndex += 1;
+      phase = trackIndex < trackCount ? emptyTrack : done;
+      break;
+
+    case done:
+    default:
+      return false;
+  }
+
+  stageLen = p - stage;
+  stagePos = 0;
+  return true;
+}
+
+size_t Loop::SmfWriter::read(uint8_t* buf, size_t len) {
+  size_t n = 0;
+  while (n < len) {
+    if (stagePos == stageLen && !stageNext())
+      break;
+    size_t k = std::min(len - n, stageLen - stagePos);
+    std::memcpy(buf + n, stage + stagePos, k);
+    n += k;
+    stagePos += k;
+  }
+  return n;
+}
+
+
+Loop::SmfReader::SmfReader(Loop& l)
+  : loop(l), phase(fileHeader),
+    format(0), trackCount(0), division(0),
+    tempo(defaultTempo), tempoSet(false),
+    tracksRead(0), trackBytes(0), ticks(0), varLen(0), skipBytes(0),
+    runningStatus(0), metaKind(0), eventLen(0), eventNeeds(0),
+    startCell(nullptr), cursor(nullptr), cursorTime(0),
+    tailCell(nullptr), tailTime(0), length(0), layerCount(0),
+    stageLen(14), stagePos(0)
+  { }
+
+bool Loop::SmfReader::readVarLen(uint8_t b) {
+  varLen = (varLen << 7) | (b & 0x7f);
+  return !(b & 0x80);
+}
+
+void Loop::SmfReader::channelEvent() {
+  uint8_t layer = (format == 0 || tracksRead == 0) ? 0 : tracksRead - 1;
+  if (layer >= maxLayers || layer >= Loop::layerLimit)
+    return;
+
+  AbsTime time = static_cast<AbsTime>(
+    uint64_t(ticks) * tempo / (uint64_t(division) * 1000));
+
+  MidiEvent ev = { runningStatus, eventData[0], eventData[1] };
+
+  if (ev.isNoteOff()) {
+    auto on = ons.find(ev.status & 0x0f, ev.data1);
+    if (on) {
+      on->cell->duration = noteDuration(time - on->start);
+      ons.remove(on);
+    }
+    return;
+  }
+
+  // merge into the loop, the cursor only ever moves forward within a track
+  while (cursor->next() && cursorTime + cursor->nextTime <= time) {
+    cursorTime += cursor->nextTime;
+    cursor = cursor->next();
+  }
+
+  if (time - cursorTime > 0xffff) {
+    abandon();    // too far apart for a DeltaTime
+    return;
+  }
+
+  Cell* c = Cell::alloc(Cell::priorityRecord);
+  if (!c) {
+    abandon();
+    return;
+  }
+  c->layer = layer;
+  c->event = ev;
+  c->duration = 0;
+
+  Cell* n = cursor->next();
+  c->link(n);
+  c->nextTime = n ? cursor->nextTime - (time - cursorTime) : 0;
+  cursor->link(c);
+  cursor->nextTime = time - cursorTime;
+  cursor = c;
+  cursorTime = time;
+
+  if (!n) {
+    tailCell = c;
+    tailTime = time;
+  }
+
+  if (ev.isNoteOn()) {
+    auto on = ons.insert(ev.status & 0x0f, ev.data1);
+    if (!on) {
+      // full, as from NoteOffs missing from the file: the note held
+      // longest is ended here, to make room
+      auto oldest = ons.most([&](const On& e) { return time - e.start; });
+      oldest->cell->duration = noteDuration(time - oldest->start);
+      ons.remove(oldest);
+      loop.cutShort += 1;
+      on = ons.insert(ev.status & 0x0f, ev.data1);
+    }
+    if (on->cell)
+      on->cell->duration = noteDuration(time - on->start);
+    on->cell = c;
+    on->start = time;
+  }
+
+  layerCount = std::max<uint8_t>(layerCount, layer + 1);
+}
+
+void Loop::SmfReader::endOfEvent() {
+  phase = delta;
+  varLen = 0;
+  if (trackBytes > 0)
+    return;
+
+  // end of the track
+  tracksRead += 1;
+  phase = tracksRead < trackCount ? chunkHeader : trailer;
+  stageLen = tracksRead < trackCount ? 8 : 4;
+  stagePos = 0;
+}
+
+void Loop::SmfReader::feed(uint8_t b) {
+  if (phase == fileHeader || phase == chunkHeader) {
+    stage[stagePos++] = b;
+    if (stagePos < stageLen)
+      return;
+    stagePos = 0;
+
+    if (phase == fileHeader) {
+      if (std::memcmp(stage, "MThd", 4) != 0 || get32(stage + 4) != 6) {
+        phase = invalid;
+        return;
+      }
+      format = get16(stage + 8);
+      trackCount = get16(stage + 10);
+      division = get16(stage + 12);
+      if (format > 1 || trackCount == 0 || division == 0 || division & 0x8000) {
+        phase = invalid;    // SMPTE time isn't supported
+        return;
+      }
+
+      loop.clear();
+      ons.clear();
+
+      startCell = Cell::alloc(Cell::priorityRecord);
+      if (!startCell) {
+        abandon();
+        return;
+      }
+      startCell->layer = startLayer;
+      startCell->event = startEvent;
+      startCell->duration = startDuration;
+      startCell->nextTime = 0;
+      tailCell = startCell;
+
+      phase = chunkHeader;
+      stageLen = 8;
+      return;
+    }
+
+    if (std::memcmp(stage, "BCYA", 4) == 0) {
+      phase = invalid;    // an export cut short, see smf.h
+      return;
+    }
+
+    trackBytes = get32(stage + 4);
+    if (std::memcmp(stage, "MTrk", 4) != 0) {
+      skipBytes = trackBytes;
+      phase = skipBytes ? skipChunk : chunkHeader;
+      return;
+    }
+
+    ticks = 0;
+    runningStatus = 0;
+    cursor = startCell;
+    cursorTime = 0;
+    ons.clear();
+      // notes left on at the end of a track have no duration
+    endOfEvent();
+    return;
+  }
+
+  if (phase == trailer) {
+    // the file is whole, but for what may follow it: an export cut short
+    // in its last track is marked after it
+    stage[stagePos++] = b;
+    if (stagePos == stageLen)
+      phase = std::memcmp(stage, "BCYA", 4) == 0 ? invalid : done;
+    return;
+  }
+
+  if (phase == skipChunk) {
+    if (--skipBytes == 0)
+      phase = chunkHeader;
+    return;
+  }
+
+  if (trackBytes == 0) {
+    phase = invalid;    // event runs past the end of the track
+    return;
+  }
+  trackBytes -= 1;
+
+  switch (phase) {
+    case delta:
+      if (readVarLen(b)) {
+        ticks += varLen;
+        phase = status;
+      }
+      return;
+
+    case status:
+      if (b == 0xff) {
+        phase = metaType;
+        return;
+      }
+      if (b == 0xf0 || b == 0xf7) {
+        varLen = 0;
+        phase = sysexLength;
+        return;
+      }
+      if (b & 0x80) {
+        runningStatus = b;
+        eventLen = 0;
+        eventNeeds = dataLength(b);
+        phase = data;
+        return;
+      }
+      if (!runningStatus) {
+        phase = invalid;
+        return;
+      }
+      eventLen = 0;
+      eventNeeds = dataLength(runningStatus);
+      phase = data;
+      // fall through - the byte is data
+
+    case data:
+      eventData[eventLen++] = b;
+      if (eventLen < eventNeeds)
+        return;
+      if (eventNeeds < 2)
+        eventData[1] = 0;
+      channelEvent();
+      if (phase == data)
+        endOfEvent();
+      return;
+
+    case metaType:
+      metaKind = b;
+      varLen = 0;
+      phase = metaLength;
+      return;
+
+    case metaLength:
+      if (!readVarLen(b))
+        return;
+      skipBytes = varLen;
+      eventLen = 0;
+      if (skipBytes) {
+        phase = metaData;
+        return;
+      }
+      // fall through - a meta event with no data
+
+    case metaData:
+      if (skipBytes) {
+        if (eventLen < sizeof(eventData))
+          eventData[eventLen++] = b;
+        if (--skipBytes)
+          return;
+      }
+
+      if (metaKind == 0x51 && eventLen == 3 && !tempoSet) {
+        // only the first tempo is used
+        tempo = uint32_t(eventData[0]) << 16
+          | uint32_t(eventData[1]) << 8 | eventData[2];
+        tempoSet = true;
+      }
+      if (metaKind == 0x2f && tracksRead == 0 && format == 1) {
+        // the end of the conductor track is the length of the loop
+        length = static_cast<AbsTime>(
+          uint64_t(ticks) * tempo / (uint64_t(division) * 1000));
+      }
+      endOfEvent();
+      return;
+
+    case sysexLength:
+      if (!readVarLen(b))
+        return;
+      skipBytes = varLen;
+      if (skipBytes) {
+        phase = skip;
+        return;
+      }
+      endOfEvent();
+      return;
+
+    case skip:
+      if (--skipBytes == 0)
+        endOfEvent();
+      return;
+
+    default:
+      phase = invalid;
+      return;
+  }
+}
+
+bool Loop::SmfReader::write(const uint8_t* buf, size_t len) {
+  for (size_t n = 0; n < len && phase != done && phase != invalid; ++n)
+    feed(buf[n]);
+    // any data past the end of the file is ignored
+
+  if (phase == invalid)
+    abandon();
+  return phase != invalid;
+}
+
+bool Loop::SmfReader::finish() {
+  if (phase != trailer && phase != done) {
+    abandon();
+    return false;
+  }
+
+  // close the loop, and position just before the start
+  length = std::max(length, tailTime);
+  if (length - tailTime > 0xffff) {
+    abandon();
+    return false;
+  }
+  tailCell->link(startCell);
+  tailCell->nextTime = length - tailTime;
+
+  loop.recentCell = tailCell;
+  loop.timeSinceRecent = tailCell->nextTime;
+  loop.firstCell = nullptr;
+  loop.length = length;
+  loop.armed = false;
+  loop.layerCount = std::max<uint8_t>(layerCount, 1);
+  loop.activeLayer = std::min<uint8_t>(
+    loop.layerCount, Loop::layerLimit - 1);
+  loop.layerCount = std::max<uint8_t>(loop.layerCount, loop.activeLayer + 1);
+  loop.layerArmed = true;
+  loop.edits += 1;
+  loop.rebuildDensity();
+
+  startCell = tailCell = nullptr;
+  return true;
+}
+
+void Loop::SmfReader::abandon() {
+  phase = invalid;
+  if (!startCell)
+    return;   // the loop hasn't been touched
+
+  tailCell->link(startCell);    // close them up so clear() frees them
+  loop.recentCell = tailCell;
+  startCell = tailCell = nullptr;
+  loop.clear();
+}
+
+
+#if !defined(ARDUINO)
+
+bool writeSmfFile(const Loop& loop, const char* path) {
+  FILE* f = std::fopen(path, "wb");
+  if (!f) return false;
+
+  Loop::SmfWriter w(loop);
+  uint8_t buf[256];
+  bool ok = true;
+  while (size_t n = w.read(buf, sizeof(buf)))
+    ok = ok && std::fwrite(buf, 1, n, f) == n;
+
+  return std::fclose(f) == 0 && ok;
+}
+
+bool readSmfFile(Loop& loop, const char* path) {
+  FILE* f = std::fopen(path, "rb");
+  if (!f) return false;
+
+  Loop::SmfReader r(loop);
+  uint8_t buf[256];
+  bool ok = true;
+  while (size_t n = std::fread(buf, 1, sizeof(buf), f))
+    ok = ok && r.write(buf, n);
+
+  std::fclose(f);
+  return r.finish() && ok;
+}
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef _INCLUDE_SMF_H_
+#define _INCLUDE_SMF_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "looper.h"
+#include "notetable.h"
+
+
+/**
+***  Standard MIDI Files
+**/
+
+// Loops are exported as type 1 files: a conductor track holding the tempo,
+// and whose end marks the length of the loop, followed by one track for each
+// layer. Times are in milliseconds: 1000 ticks per quarter at 60 bpm.
+//
+// Like the loop image, both directions work in chunks of any size, so a
+// file can be streamed over serial without a buffer for the whole thing.
+//
+// An export that can't be finished, because the loop changed under it, is
+// still sent at the lengths its headers gave: the track being written is
+// filled out with a text event, a chunk of type "BCYA" follows it, and the
+// tracks left are sent empty. Readers that don't know the chunk skip it,
+// SmfReader takes it as a bad file, even just after the last track, if it
+// is given that far.
+
+
+class Loop::SmfWriter {
+public:
+  SmfWriter(const Loop&);
+
+  size_t read(uint8_t* buf, size_t len);
+    // fill buf with the next part of the file, returns 0 when done
+
+  bool stale() const { return loop.edits != edits; }
+    // the loop has changed since the file was started, start over
+
+  void abort();
+    // finish the file early, marked as cut short, see above
+  bool cutShort() const { return aborted; }
+    // abort() was called before all of the file was staged
+
+private:
+  const Loop& loop;
+  const uint16_t edits;
+  const Cell* startCell;
+
+  struct Off {
+    AbsTime time;
+    uint8_t status;
+    uint8_t note;
+  };
+
+  struct Track {
+    uint8_t layer;
+    const Cell* cell;   // next cell to consider, nullptr at end of loop
+    AbsTime cellTime;
+    AbsTime lastTime;
+    std::array<Off, 16> offs;
+    uint8_t offCount;
+  };
+
+  void startTrack(Track&, uint8_t layer) const;
+  bool nextEvent(Track&, AbsTime&, MidiEvent&) const;
+  uint32_t trackSize(uint8_t layer) const;
+
+  enum Phase {
+    fileHeader, trackHeader, tempoEvent, trackEvents,
+    abortTrack, abortText, abortChunk, emptyTrack,
+    done
+  };
+  Phase phase;
+  bool aborted;
+  uint8_t trackCount;
+  uint8_t trackIndex;     // 0 is the conductor track, layer n is n + 1
+  uint32_t trackLeft;     // bytes of the track not yet staged
+  uint32_t textLeft;      // bytes of filler not yet staged
+  uint32_t textSent;
+  Track track;
+
+  bool stageNext();
+
+  uint8_t stage[16];
+  size_t stageLen;
+  size_t stagePos;
+};
+
+
+class Loop::SmfReader {
+public:
+  SmfReader(Loop&);
+
+  bool write(const uint8_t* buf, size_t len);
+    // consume the next part of the file, returns false if it can't be read
+
+  bool complete() const { return phase == trailer || phase == done; }
+
+  bool finish();
+    // returns true if a whole file was read, and the loop is now playing it
+
+private:
+  Loop& loop;
+
+  enum Phase {
+    fileHeader, chunkHeader, skipChunk,
+    delta, status, data, metaType, metaLength, metaData, sysexLength, skip,
+    trailer, done, invalid
+  };
+  Phase phase;
+
+  void feed(uint8_t);
+  bool readVarLen(uint8_t);
+  void endOfEvent();
+  void channelEvent();
+  void abandon();
+
+  uint16_t format;
+  uint16_t trackCount;
+  uint16_t division;
+  uint32_t tempo;
+  bool tempoSet;
+
+  uint16_t tracksRead;
+  uint32_t trackBytes;
+  uint32_t ticks;
+  uint32_t varLen;
+  uint32_t skipBytes;
+
+  uint8_t runningStatus;
+  uint8_t metaKind;
+  uint8_t eventData[3];
+  uint8_t eventLen;
+  uint8_t eventNeeds;
+
+  Cell* startCell;
+  Cell* cursor;       // merge point, the last cell at or before this time
+  AbsTime cursorTime;
+  Cell* tailCell;
+  AbsTime tailTime;
+  AbsTime length;
+  uint8_t layerCount;
+
+  struct On {
+    Cell* cell;       // NoteOn read, awaiting its NoteOff to set duration
+    AbsTime start;
+  };
+  NoteTable<On, config.noteSlots> ons;
+    // by channel and note, as type 1 tracks may use the same notes on
+    // different channels
+
+  uint8_t stage[14];
+  size_t stageLen;
+  size_t stagePos;
+};
+
+
+#if !defined(ARDUINO)
+// host side versions for reading and writing files
+
+bool writeSmfFile(const Loop&, const char* path);
+bool readSmfFile(Loop&, const char* path);
+#endif
+
+
+#endif // _INCLUDE_SMF_H_
@@ -0,0 +1,628 @@
+#include "soak.h"
+
+#if !defined(ARDUINO)
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <tuple>
+#include <vector>
+
+#include "looper.h"
+
+
+namespace {
+
+  struct Output {
+    AbsTime   time;
+    MidiEvent ev;
+  };
+
+  bool operator<(const Output& a, const Output& b) {
+    return std::tie(a.time, a.ev.status, a.ev.data1, a.ev.data2)
+      < std::tie(b.time, b.ev.status, b.ev.data1, b.ev.data2);
+  }
+
+  bool operator==(const Output& a, const Output& b) {
+    return a.time == b.time && a.ev.status == b.ev.status
+      && a.ev.data1 == b.ev.data1 && a.ev.data2 == b.ev.data2;
+  }
+
+  inline uint16_t key(const MidiEvent& ev)
+    { return (ev.status & 0x0f) << 7 | (ev.data1 & 0x7f); }
+
+
+  // The model keeps the loop as a list of events at their positions in it,
+  // and plays them by comparing times. It is slow, and meant to be plainly
+  // right: each rule of looper.cpp is written out once, where it applies.
+  // It plays through the same shaping as the loop only while that is left
+  // alone, which the soak does.
+
+  const size_t noteTableLimit = config.noteSlots * 3 / 4;
+    // as full as a NoteTable gets, see notetable.h
+
+  class Model {
+  public:
+    Model(std::vector<Output>& o)
+      : out(o), now(0),
+        armed(true), activeLayer(0), layerArmed(false), armedTime(0),
+        overdubbing(false),
+        started(false), closed(false), passStart(0), length(0),
+        lastRecorded(0)
+    {
+      mutes.fill(false);
+      cursor = cells.end();
+    }
+
+    void advance(AbsTime t) {
+      while (true) {
+        AbsTime offAt = nextOff();
+        AbsTime cellAt = nextCell();
+        AbsTime at = std::min(offAt, cellAt);
+        if (at > t) break;
+
+        now = at;
+        if (offAt <= cellAt)  sendOffs();
+        else                  reachCell();
+      }
+      now = t;
+    }
+
+    void addEvent(const MidiEvent& ev) {
+      if (ev.isNoteOff()) {
+        emit(ev);
+        finishAwaiting(ev);
+        return;
+      }
+
+      if (armed) {
+        clear();
+        armed = false;
+      }
+      layerArmed = false;
+      mutes[activeLayer] = false;
+
+      if (ev.isNoteOn())
+        endPending(ev);
+      emit(ev);
+
+      bool first = !started;
+      if (first) {
+        started = true;
+        passStart = now;
+      }
+
+      auto c = cells.insert(cursor,
+        Recorded{ now - passStart, activeLayer, ev, 0 });
+      lastRecorded = now;
+      if (ev.isNoteOn())
+        startAwaiting(c);
+
+      if (first)
+        play(startLayer, startEvent, startDuration);
+    }
+
+    void keep() {
+      if (started && !closed) {
+        closed = true;
+        length = std::max<AbsTime>(now - passStart, 1);
+      }
+      if (activeLayer < Loop::layerLimit - 1)
+        activeLayer += 1;
+      layerArmed = true;
+      advance(now);
+    }
+
+    void arm() { armed = true; }
+
+    void clear() {
+      for (auto& o : offs) emit(o.ev);
+      offs.clear();
+      offIndex.clear();
+        // every voice is ended
+
+      cells.clear();
+      cursor = cells.end();
+      awaiting.clear();
+      started = false;
+      closed = false;
+      length = 0;
+      armed = true;
+      activeLayer = 0;
+      layerArmed = true;
+      mutes.fill(false);
+    }
+
+    void layerMute(uint8_t layer, bool muted)
+      { if (layer < Loop::layerLimit) mutes[layer] = muted; }
+
+    void layerArm(uint8_t layer) {
+      if (layer >= Loop::layerLimit) return;
+      if (layerArmed && activeLayer == layer && now < armedTime + 1000) {
+        layerArmed = false;
+        return;
+      }
+      activeLayer = layer;
+      layerArmed = true;
+      armedTime = now;
+    }
+
+    void overdub(bool on) { overdubbing = on; }
+
+    // for the soak to look at
+    bool recording() const    { return started && !closed; }
+    AbsTime since() const     { return now - passStart; }
+    AbsTime sinceRecorded() const { return now - lastRecorded; }
+    size_t cellsRecorded() const  { return cells.size() + (started ? 1 : 0); }
+      // the events, and the start cell
+
+    bool densityMatches(const Loop::Density& d) const {
+      Loop::Density m;
+      for (auto& l : m.notes) l.fill(0);
+      if (closed)
+        for (auto& c : cells)
+          if (c.ev.isNoteOn() && c.layer < Loop::layerLimit) {
+            auto col = std::min<AbsTime>(
+              c.pos * Loop::densityColumns / length, Loop::densityColumns - 1);
+            m.notes[c.layer][col] = std::min(m.notes[c.layer][col] + 1, 255);
+          }
+      return m.notes == d.notes;
+    }
+
+  private:
+    std::vector<Output>& out;
+    AbsTime now;
+
+    bool armed;
+    uint8_t activeLayer;
+    bool layerArmed;
+    AbsTime armedTime;
+    bool overdubbing;
+    std::array<bool, Loop::layerLimit> mutes;
+
+    struct Recorded {
+      AbsTime   pos;        // from the start of the loop
+      uint8_t   layer;
+      MidiEvent ev;
+      AbsTime   duration;   // 0 until the NoteOff is heard
+    };
+    typedef std::list<Recorded>::iterator Cell;
+
+    std::list<Recorded> cells;    // in the order they are played
+    Cell cursor;                  // the next to be reached
+
+    bool started;       // something has been recorded
+    bool closed;        // and the loop has been kept
+    AbsTime passStart;  // when this pass of the loop started
+    AbsTime length;
+    AbsTime lastRecorded;
+
+    struct Awaiting {
+      Cell      cell;
+      AbsTime   start;
+    };
+    std::map<uint16_t, Awaiting> awaiting;
+
+    struct Off {
+      AbsTime   due;
+      MidiEvent ev;
+    };
+    typedef std::list<Off>::iterator OffRef;
+    std::list<Off> offs;
+    std::map<uint16_t, OffRef> offIndex;
+
+    static const AbsTime never = 0xffffffff;
+
+    void emit(const MidiEvent& ev) { out.push_back({ now, ev }); }
+
+    AbsTime nextOff() const {
+      AbsTime t = never;
+      for (auto& o : offs) t = std::min(t, o.due);
+      return t;
+    }
+
+    AbsTime nextCell() const {
+      if (!closed)                return never;
+      if (cursor == cells.end())  return passStart + length;
+      return passStart + cursor->pos;
+    }
+
+    void sendOffs() {
+      for (auto o = offs.begin(); o != offs.end();) {
+        if (o->due > now) {
+          ++o;
+          continue;
+        }
+        emit(o->ev);
+        auto i = offIndex.find(key(o->ev));
+        if (i != offIndex.end() && i->second == o)
+          offIndex.erase(i);
+        o = offs.erase(o);
+      }
+    }
+
+    void reachCell() {
+      if (cursor == cells.end()) {
+        // around to the start again
+        passStart += length;
+        cursor = cells.begin();
+        play(startLayer, startEvent, startDuration);
+        return;
+      }
+
+      Recorded& c = *cursor;
+      bool held = false;
+      if (c.ev.isNoteOn()) {
+        auto a = awaiting.find(key(c.ev));
+        held = a != awaiting.end() && a->second.cell == cursor;
+      }
+      if (c.layer == activeLayer && !layerArmed && !overdubbing && !held) {
+        // recording over this layer: what was there is dropped, but for a
+        // note still held since it was recorded
+        cursor = cells.erase(cursor);
+        return;
+      }
+
+      play(c.layer, c.ev, c.duration);
+      ++cursor;
+    }
+
+    void play(uint8_t layer, const MidiEvent& ev, AbsTime duration) {
+      if (layer < Loop::layerLimit && mutes[layer])
+        return;
+
+      if (ev.isNoteOn()) {
+        if (duration == 0)
+          return;
+          // still held, or its NoteOff was never heard
+
+        endPending(ev);
+        if (offIndex.size() >= noteTableLimit)
+          steal();
+        emit(ev);
+
+        if (closed)
+          duration = std::min(duration, length);
+        MidiEvent off = ev;
+        off.data2 = 0;
+        offs.push_front({ now + duration, off });
+        offIndex[key(ev)] = offs.begin();
+      } else {
+        emit(ev);
+      }
+    }
+
+    void steal() {
+      // the voice with the soonest NoteOff, the most recent of any tied
+      auto v = offs.begin();
+      for (auto o = offs.begin(); o != offs.end(); ++o)
+        if (o->due < v->due) v = o;
+      endPending(v->ev);
+    }
+
+    void endPending(const MidiEvent& ev) {
+      auto i = offIndex.find(key(ev));
+      if (i == offIndex.end()) return;
+      emit(i->second->ev);
+      offs.erase(i->second);
+      offIndex.erase(i);
+    }
+
+    void startAwaiting(Cell c) {
+      finishAwaiting(c->ev);
+      if (awaiting.size() < noteTableLimit)
+        awaiting[key(c->ev)] = { c, now };
+    }
+
+    void finishAwaiting(const MidiEvent& ev) {
+      auto a = awaiting.find(key(ev));
+      if (a == awaiting.end()) return;
+      a->second.cell->duration =
+        std::min<AbsTime>(std::max<AbsTime>(now - a->second.start, 1), 0xffff);
+      awaiting.erase(a);
+    }
+  };
+
+
+  // the loop under test plays into here
+  std::vector<Output>* soakOut = nullptr;
+  Loop* soakLoopUnderTest = nullptr;
+
+  void soakEvent(const MidiEvent& ev) {
+    soakOut->push_back({ soakLoopUnderTest->time(), ev });
+  }
+
+
+  class Random {
+  public:
+    Random(uint32_t seed) : state(seed ? seed : 1) { }
+    uint32_t next() {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      return state;
+    }
+    uint32_t below(uint32_t n) { return next() % n; }
+  private:
+    uint32_t state;
+  };
+
+
+  // What is sounding, from what was played, to find hung notes.
+  class Sounding {
+  public:
+    Sounding() { counts.fill(0); }
+
+    void track(const std::vector<Output>& outs) {
+      for (auto& o : outs) {
+        uint16_t k = key(o.ev);
+        if (o.ev.isNoteOn()) {
+          if (counts[k]++ == 0) since[k] = o.time;
+        } else if (o.ev.isNoteOff()) {
+          if (counts[k]) counts[k] -= 1;
+        }
+      }
+    }
+
+    bool hung(FILE* report) const {
+      bool any = false;
+      for (size_t k = 0; k < counts.size(); ++k)
+        if (counts[k]) {
+          std::fprintf(report, "  hung: channel %u note %u, since %lu\n",
+            unsigned(k >> 7) + 1, unsigned(k & 0x7f),
+            static_cast<unsigned long>(since[k]));
+          any = true;
+        }
+      return any;
+    }
+
+  private:
+    std::array<uint16_t, 16 * 128> counts;
+    std::array<AbsTime, 16 * 128> since;
+  };
+
+
+  void describe(FILE* report, const char* who, const std::vector<Output>& o) {
+    std::fprintf(report, "  %s:\n", who);
+    size_t n = std::min<size_t>(o.size(), 24);
+    for (size_t i = 0; i < n; ++i)
+      std::fprintf(report, "    %lu %02x %02x %02x\n",
+        static_cast<unsigned long>(o[i].time),
+        o[i].ev.status, o[i].ev.data1, o[i].ev.data2);
+    if (n < o.size())
+      std::fprintf(report, "    ... and %u more\n", unsigned(o.size() - n));
+  }
+
+  uint32_t failures() {
+    uint32_t n = 0;
+    for (int p = 0; p < Cell::priorityCount; ++p)
+      n += Cell::failures(Cell::Priority(p));
+    return n;
+  }
+}
+
+
+SoakResult soakLoop(uint32_t seed, uint32_t inputs, bool longNotes,
+    bool manyNotes, FILE* report) {
+  Loop::begin();
+  uint16_t freeAtStart = Cell::freeCount();
+  uint32_t failedAtStart = failures();
+
+  std::vector<Output> loopOut, modelOut;
+  Loop loop(soakEvent);
+  Model model(modelOut);
+  soakOut = &loopOut;
+  soakLoopUnderTest = &loop;
+
+  Random rand(seed);
+  Sounding sounding;
+  SoakResult result = { 0, 0, 0, true };
+
+  struct Held {
+    MidiEvent ev;
+    AbsTime   until;
+  };
+  std::vector<Held> held;
+  const size_t mostHeld = manyNotes ? config.noteSlots : 4;
+  const AbsTime longestNote = longNotes ? 3000 : 400;
+  const AbsTime shortestLoop = 1000;
+  const size_t mostCells = 600;
+
+  AbsTime now = 0;
+  bool overdubbing = false;
+
+  auto fail = [&](const char* what) {
+    std::fprintf(report, "seed %lu, input %llu, at %lu: %s\n",
+      static_cast<unsigned long>(seed),
+      static_cast<unsigned long long>(result.inputs),
+      static_cast<unsigned long>(now), what);
+    result.ok = false;
+  };
+
+  auto compare = [&]() {
+    sounding.track(loopOut);
+      // in the order played: within a millisecond, order matters here
+
+    // but not between the loop and the model
+    std::sort(loopOut.begin(), loopOut.end());
+    std::sort(modelOut.begin(), modelOut.end());
+    if (loopOut != modelOut) {
+      fail("played differently");
+      describe(report, "loop", loopOut);
+      describe(report, "model", modelOut);
+    }
+    result.outputs += loopOut.size();
+    loopOut.clear();
+    modelOut.clear();
+  };
+
+  while (result.ok && result.inputs < inputs) {
+    AbsTime then = now + 1 + (rand.below(50) ? rand.below(150) : rand.below(1500));
+
+    // a held note is let go, when it's due, before anything else can happen
+    auto h = std::min_element(held.begin(), held.end(),
+      [](const Held& a, const Held& b) { return a.until < b.until; });
+    if (h != held.end() && h->until <= then) {
+      now = std::max(h->until, now + 1);
+      MidiEvent off = { uint8_t(0x80 | (h->ev.status & 0x0f)), h->ev.data1, 64 };
+      held.erase(h);
+
+      loop.advance(now);  model.advance(now);
+      loop.addEvent(off); model.addEvent(off);
+      result.inputs += 1;
+      compare();
+      continue;
+    }
+
+    now = then;
+    loop.advance(now);
+    model.advance(now);
+
+    uint32_t r = rand.below(100);
+    if (model.recording() && (model.sinceRecorded() > 10000 || model.since() > 8000))
+      r = 0;    // the first pass has gone on long enough, keep it
+    else if (model.cellsRecorded() > mostCells)
+      r = 5;    // running up the cells, start again
+
+    if (r < 4) {
+      if (!model.recording() || model.since() >= shortestLoop) {
+        loop.keep();
+        model.keep();
+      }
+    } else if (r < 6) {
+      loop.arm();
+      model.arm();
+    } else if (r < 7) {
+      loop.clear();
+      model.clear();
+    } else if (r < 11) {
+      uint8_t layer = rand.below(Loop::layerLimit);
+      bool muted = rand.below(2);
+      loop.layerMute(layer, muted);
+      model.layerMute(layer, muted);
+    } else if (r < 14) {
+      uint8_t layer = rand.below(Loop::layerLimit);
+      loop.layerArm(layer);
+      model.layerArm(layer);
+    } else if (r < 16) {
+      overdubbing = !overdubbing;
+      loop.overdub(overdubbing);
+      model.overdub(overdubbing);
+    } else if (r < 36) {
+      MidiEvent cc = { 0xb0, uint8_t(1 + rand.below(8)), uint8_t(rand.below(128)) };
+      loop.addEvent(cc);
+      model.addEvent(cc);
+    } else if (held.size() < mostHeld) {
+      MidiEvent on = { uint8_t(0x90 | rand.below(2)),
+        uint8_t(36 + rand.below(49)), uint8_t(1 + rand.below(127)) };
+      bool taken = std::any_of(held.begin(), held.end(),
+        [&](const Held& x) { return key(x.ev) == key(on); });
+      if (!taken) {
+        held.push_back({ on, now + 1 + rand.below(longestNote) });
+        loop.addEvent(on);
+        model.addEvent(on);
+      }
+    }
+    result.inputs += 1;
+
+    compare();
+
+    unsigned recorded =
+      freeAtStart - Cell::freeCount() - loop.status().cellsPlaying;
+    if (result.ok && recorded != model.cellsRecorded()) {
+      fail("cells recorded differ");
+      std::fprintf(report, "  loop %u, model %u\n",
+        recorded, unsigned(model.cellsRecorded()));
+    }
+    if (result.ok && failures() != failedAtStart)
+      fail("ran out of cells");
+    if (result.ok && !model.densityMatches(*loop.status().density))
+      fail("density differs");
+  }
+
+  // let go of everything, and wait out the NoteOffs, even after a failure,
+  // so the next soak starts with the pool as it was
+  for (auto& x : held) {
+    MidiEvent off = { uint8_t(0x80 | (x.ev.status & 0x0f)), x.ev.data1, 64 };
+    now += 1;
+    loop.advance(now);  model.advance(now);
+    loop.addEvent(off); model.addEvent(off);
+  }
+  held.clear();
+  loop.clear();
+  model.clear();
+  now += 0x10000;
+  loop.advance(now);
+  model.advance(now);
+
+  if (result.ok) {
+    compare();
+
+    if (result.ok && Cell::freeCount() != freeAtStart) {
+      fail("cells leaked");
+      std::fprintf(report, "  %u cells not freed\n",
+        unsigned(freeAtStart - Cell::freeCount()));
+    }
+    if (result.ok && sounding.hung(report))
+      fail("notes left sounding");
+  }
+
+  result.simulated = now;
+  soakOut = nullptr;
+  soakLoopUnderTest = nullptr;
+  return result;
+}
+
+
+#if defined(BICYCLE_SOAK_MAIN)
+
+int main(int argc, char* argv[]) {
+  bool longNotes = false;
+  bool manyNotes = false;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+    if (!std::strcmp(argv[arg], "-l"))
+      longNotes = true;
+    else if (!std::strcmp(argv[arg], "-p"))
+      manyNotes = true;
+    else {
+      std::fprintf(stderr, "usage: %s [-l] [-p] [runs [inputs [seed]]]\n",
+        argv[0]);
+      return 2;
+    }
+  }
+  unsigned long runs = arg < argc ? std::strtoul(argv[arg++], nullptr, 0) : 100;
+  unsigned long inputs = arg < argc ? std::strtoul(argv[arg++], nullptr, 0) : 20000;
+  unsigned long seed = arg < argc ? std::strtoul(argv[arg++], nullptr, 0) : 1;
+
+  SoakResult total = { 0, 0, 0, true };
+  unsigned long failed = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < runs; ++i) {
+    SoakResult r = soakLoop(seed + i, inputs, longNotes, manyNotes, stdout);
+    total.inputs += r.inputs;
+    total.outputs += r.outputs;
+    total.simulated += r.simulated;
+    if (!r.ok) failed += 1;
+  }
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+
+  double secs = std::max(took.count(), 1e-9);
+  std::printf("%lu runs, %lu failed\n", runs, failed);
+  std::printf("%llu inputs, %llu outputs, %.0f s of playing, in %.2f s\n",
+    static_cast<unsigned long long>(total.inputs),
+    static_cast<unsigned long long>(total.outputs),
+    total.simulated / 1000.0, took.count());
+  std::printf("%.0f events/s\n", (total.inputs + total.outputs) / secs);
+    // includes the model's time, so compare runs only with each other
+  return failed ? 1 : 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _INCLUDE_SOAK_H_
+#define _INCLUDE_SOAK_H_
+
+#if !defined(ARDUINO)
+
+#include <cstdint>
+#include <cstdio>
+
+
+// Soak testing, on the host: drives a Loop with a long random sequence of
+// notes, CCs, and controls, on a virtual clock, and alongside it a simple
+// model of what the loop should play. What each plays is compared a
+// millisecond at a time. As it goes, the cells the loop holds, and its
+// density counts, are checked against the model, and at the end, after
+// everything has been let go, the pool must be as full as it was, and no note
+// may still be sounding.
+//
+// The random playing stays where the model is exact: notes shorter than the
+// loop, a few held at once, loops of a second or more, and far from running
+// out of cells. With longNotes, notes may also be held for longer than the
+// loop, across its start. With manyNotes, as many are held at once as the
+// note tables have slots, more than they will take, so voices are stolen,
+// and some notes never get a duration.
+//
+// Build with:  g++ -O2 -DBICYCLE_SOAK_MAIN beatfit.cpp cell.cpp looper.cpp soak.cpp
+
+struct SoakResult {
+  uint64_t  inputs;       // events and controls given to the loop
+  uint64_t  outputs;      // events the loop played
+  uint64_t  simulated;    // milliseconds of virtual time
+  bool      ok;
+};
+
+SoakResult soakLoop(uint32_t seed, uint32_t inputs, bool longNotes,
+  bool manyNotes, FILE* report);
+  // stops at the first problem, and describes it to report
+
+#endif
+
+#endif // _INCLUDE_SOAK_H_
@@ -0,0 +1,115 @@
+#include "transfer.h"
+
+#include <algorithm>
+#include <new>
+
+#include <Arduino.h>
+
+#include "eventlog.h"
+#include "smf.h"
+
+
+namespace {
+  enum Mode { idle, exporting, importing };
+  Mode mode = idle;
+
+  alignas(Loop::SmfWriter) uint8_t writerSpace[sizeof(Loop::SmfWriter)];
+  Loop::SmfWriter* writer = nullptr;
+
+  alignas(Loop::SmfReader) uint8_t readerSpace[sizeof(Loop::SmfReader)];
+  Loop::SmfReader* reader = nullptr;
+
+  unsigned long lastData;
+  const unsigned long importTimeout = 2000;
+
+  const size_t chunkSize = 64;
+
+  void endExport(Loop& loop) {
+    bool cut = writer->cutShort();
+    writer->~SmfWriter();
+    writer = nullptr;
+    mode = idle;
+    loop.recordPause(false);
+
+    if (cut) logMessage("export cut short, the loop changed");
+  }
+
+  void endImport(Loop& loop) {
+    bool ok = reader->finish();
+    reader->~SmfReader();
+    reader = nullptr;
+    mode = idle;
+    loop.recordPause(false);
+
+    logMessage(ok ? "imported" : "import failed");
+  }
+}
+
+
+bool transferBusy() {
+  return mode != idle;
+}
+
+void transferUpdate(unsigned long now, Loop& loop) {
+  uint8_t buf[chunkSize];
+
+  switch (mode) {
+    case idle:
+      if (!Serial.available() || !logIdle())
+        break;
+        // the command waits for the log to finish the record it's sending
+
+      switch (Serial.read()) {
+        case 'E':
+          writer = new (writerSpace) Loop::SmfWriter(loop);
+          mode = exporting;
+          loop.recordPause(true);
+          break;
+
+        case 'I':
+          reader = new (readerSpace) Loop::SmfReader(loop);
+          lastData = now;
+          mode = importing;
+          loop.recordPause(true);
+            // the reader builds the new loop apart from the old, and takes
+            // its place at the end: anything recorded meanwhile would be lost
+          break;
+
+        case 'L':
+          logBinary(!logBinary());
+          break;
+      }
+      break;
+
+    case exporting: {
+      if (writer->stale())
+        writer->abort();
+        // the loop changed anyway, as from a control, or a note held from
+        // before, see smf.h
+
+      int room = Serial.availableForWrite();
+      if (room <= 0)
+        break;
+
+      size_t n = writer->read(buf, std::min<size_t>(room, chunkSize));
+      if (n)  Serial.write(buf, n);
+      else    endExport(loop);
+      break;
+    }
+
+    case importing: {
+      int avail = Serial.available();
+      if (avail <= 0) {
+        if (now - lastData > importTimeout)
+          endImport(loop);
+        break;
+      }
+
+      size_t n = Serial.readBytes(buf, std::min<size_t>(avail, chunkSize));
+      lastData = now;
+      if (!reader->write(buf, n) || reader->complete())
+        endImport(loop);
+      break;
+    }
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef _INCLUDE_TRANSFER_H_
+#define _INCLUDE_TRANSFER_H_
+
+#include "looper.h"
+
+
+void transferUpdate(unsigned long, Loop&);
+  // call from loop(), moves a bounded amount of data each time
+
+  // Commands are single bytes sent over Serial:
+  //    'E'   export the loop as a Standard MIDI File
+  //    'I'   import the loop from the Standard MIDI File that follows
+  //    'L'   switch the event log between text and binary, see eventlog.h
+  // While a file goes either way, what is played is heard, but not recorded.
+
+bool transferBusy();
+  // a file is going over Serial, so nothing else should be sent
+
+
+#endif // _INCLUDE_TRANSFER_H_
@@ -0,0 +1,79 @@
+#include "usbmidi.h"
+
+
+namespace {
+  // CINs for the system messages, indexed by the low nibble of the status
+  const uint8_t systemCodeIndex[16] = {
+    0x4,    // F0   SysEx start
+    0x2,    // F1   MTC quarter frame
+    0x3,    // F2   Song position pointer
+    0x2,    // F3   Song select
+    0x5,    // F4   undefined
+    0x5,    // F5   undefined
+    0x5,    // F6   Tune request
+    0x5,    // F7   SysEx end
+    0xf,    // F8   Timing clock
+    0xf,    // F9   undefined
+    0xf,    // FA   Start
+    0xf,    // FB   Continue
+    0xf,    // FC   Stop
+    0xf,    // FD   undefined
+    0xf,    // FE   Active sensing
+    0xf,    // FF   Reset
+  };
+
+  // MIDI bytes carried, indexed by CIN
+  const uint8_t codeIndexLength[16] = {
+    0,      // 0    reserved
+    0,      // 1    reserved (cable events)
+    2,      // 2    two byte system common
+    3,      // 3    three byte system common
+    3,      // 4    SysEx start or continue
+    1,      // 5    single byte system common, or SysEx end with one byte
+    2,      // 6    SysEx end with two bytes
+    3,      // 7    SysEx end with three bytes
+    3,      // 8    Note off
+    3,      // 9    Note on
+    3,      // A    Poly aftertouch
+    3,      // B    Control change
+    2,      // C    Program change
+    2,      // D    Channel aftertouch
+    3,      // E    Pitch bend
+    1,      // F    single byte
+  };
+}
+
+
+uint8_t usbMidiCodeIndex(uint8_t status) {
+  if (status < 0x80)  return 0xf;   // not a status, sent as a lone byte
+  if (status < 0xf0)  return status >> 4;
+  return systemCodeIndex[status & 0x0f];
+}
+
+uint8_t usbMidiLength(uint8_t codeIndex) {
+  return codeIndexLength[codeIndex & 0x0f];
+}
+
+void usbMidiEncode(const MidiEvent& ev, uint8_t packet[4]) {
+  uint8_t cin = usbMidiCodeIndex(ev.status);
+  uint8_t len = usbMidiLength(cin);
+
+  packet[0] = cin;    // cable 0
+  packet[1] = ev.status;
+  packet[2] = len > 1 ? ev.data1 : 0;
+  packet[3] = len > 2 ? ev.data2 : 0;
+}
+
+bool usbMidiIsSysEx(const uint8_t packet[4]) {
+  switch (packet[0] & 0x0f) {
+    case 0x4:
+    case 0x6:
+    case 0x7:
+      return true;
+    case 0x5:
+      // a lone byte: either the end of SysEx, or a system common message
+      return packet[1] == 0xf7 || packet[1] < 0x80;
+    default:
+      return false;
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef _INCLUDE_USBMIDI_H_
+#define _INCLUDE_USBMIDI_H_
+
+#include <cstdint>
+
+#include "types.h"
+
+
+// USB-MIDI event packets are four bytes: a cable number and Code Index Number
+// (CIN), which says what kind of message follows, then up to three bytes of
+// MIDI. SysEx is carried three bytes at a time, so a dump can be streamed a
+// packet at a time, never held in full.
+
+uint8_t usbMidiCodeIndex(uint8_t status);
+  // the CIN for a message starting with this status byte
+  // for 0xF0 it is SysEx start, for 0xF7 SysEx end alone in a packet
+
+uint8_t usbMidiLength(uint8_t codeIndex);
+  // how many of the three MIDI bytes a packet with this CIN carries
+
+void usbMidiEncode(const MidiEvent&, uint8_t packet[4]);
+  // encodes any complete, non-SysEx, message, unused bytes are zeroed
+
+bool usbMidiIsSysEx(const uint8_t packet[4]);
+  // the packet carries part of a SysEx message
+
+inline MidiEvent usbMidiDecode(const uint8_t packet[4]) {
+  return { packet[1], packet[2], packet[3] };
+}
+
+
+#endif // _INCLUDE_USBMIDI_H_